@@ -0,0 +1,26 @@
+#include "arena.h"
+
+// Size (in floats) of the blocks the arena is carved from, unless a single
+// allocation needs more.
+static const size_t ARENA_BLOCK_FLOATS = 1 << 16;
+
+draw_arena::~draw_arena()
+{
+    for(size_t i = 0; i < blocks.size(); i++) {
+        delete [] blocks[i].data;
+    }
+}
+
+// The current block is full; move on to the next block that is large
+// enough, allocating one if there is none.
+float* draw_arena::alloc_slow(int n)
+{
+    if(block < blocks.size()) { block++; }
+    while(block < blocks.size() && blocks[block].size < (size_t)n) { block++; }
+    if(block == blocks.size()) {
+        size_t size = n > (int)ARENA_BLOCK_FLOATS ? n : ARENA_BLOCK_FLOATS;
+        blocks.push_back(chunk{new float[size], size});
+    }
+    used = n;
+    return blocks[block].data;
+}
@@ -0,0 +1,65 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <cstddef>
+#include <vector>
+
+// A bump allocator for float arrays whose lifetime is at most one render
+// call, such as the data of vertices created by clipping.  Memory is taken
+// from large blocks that are kept when the arena is reset, so once the
+// blocks have grown to what a render needs, allocating from the arena never
+// touches the heap.  Pointers stay valid until the arena is reset, or
+// rewound to a position taken before they were allocated.
+class draw_arena
+{
+public:
+    // A point in the allocation sequence, returned by mark.
+    struct position
+    {
+        size_t block, used;
+    };
+
+    draw_arena() {}
+    ~draw_arena();
+
+    // Return room for n floats.  The contents are uninitialized.
+    float* alloc(int n)
+    {
+        if(block < blocks.size() && used + n <= blocks[block].size) {
+            float* p = blocks[block].data + used;
+            used += n;
+            return p;
+        }
+        return alloc_slow(n);
+    }
+
+    // Current position; passing it to rewind frees everything allocated
+    // since.
+    position mark() const
+    {return position{block, used};}
+
+    void rewind(const position& p)
+    {block = p.block; used = p.used;}
+
+    // Free everything.  Called at the start of every render.
+    void reset()
+    {block = 0; used = 0;}
+
+private:
+    float* alloc_slow(int n);
+
+    struct chunk
+    {
+        float* data;
+        size_t size;
+    };
+
+    std::vector<chunk> blocks;
+    size_t block = 0;
+    size_t used = 0;
+
+    draw_arena(const draw_arena&);
+    draw_arena& operator = (const draw_arena&);
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __CLIP__
+#define __CLIP__
+
+#include "common.h"
+
+// This file contains the clip-space constants shared between the clipper in
+// driver_state.cpp and the outcode kernels in clip_simd.cpp.
+
+// Distance (in pixels) by which the guard band extends past each edge of the
+// image.  Triangles are only clipped against the sides of the guard band;
+// the rasterizer clamps their bounding box to the image.  This must keep
+// snapped vertex positions well inside MAX_FIXED_COORD.
+static const float GUARD_BAND_PIXELS = 8192;
+
+// Number of planes clip_triangle clips against: the near plane, then the
+// left, right, bottom and top sides of the guard band.
+static const int CLIP_PLANES = 5;
+
+// Outcode bits: bits 0-5 are set if the vertex is outside the left, right,
+// bottom, top, near or far plane of the view volume, and bit 6+f is set if it
+// is outside clip plane f.
+static const int OUTCODE_VIEW = (1 << 6) - 1;
+static const int OUTCODE_CLIP = ((1 << CLIP_PLANES) - 1) << 6;
+
+// The guard band is |x| <= gx*w, |y| <= gy*w in clip coordinates, where gx
+// and gy are the scales for the image width and height.
+inline float guard_band_scale(int size)
+{
+    return 1 + 2 * GUARD_BAND_PIXELS / size;
+}
+
+// Compute the outcodes of VERTEX_BATCH_SIZE vertices, whose clip-space
+// positions are given in structure-of-arrays form (coordinate i of vertex k is
+// position[i][k]), for an image of width x height pixels.
+void batch_outcodes(const float position[4][VERTEX_BATCH_SIZE], int width, int height,
+    int codes[VERTEX_BATCH_SIZE]);
+
+#endif
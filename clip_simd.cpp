@@ -0,0 +1,124 @@
+#include "clip.h"
+
+// Outcode kernels for a batch of vertices.  Like the pixel kernels in
+// raster_simd.cpp, the vector versions are compiled for SSE4.2 and AVX2 using
+// function target attributes and one is picked at run time.  All versions
+// evaluate the same expressions as the scalar one, so they give identical
+// outcodes.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CLIP_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static void outcodes_scalar(const float position[4][VERTEX_BATCH_SIZE], float gx, float gy,
+    int codes[VERTEX_BATCH_SIZE])
+{
+    for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+        float x = position[0][k], y = position[1][k], z = position[2][k], w = position[3][k];
+        int code = 0;
+        code |= (x < -w) << 0;
+        code |= (x > w) << 1;
+        code |= (y < -w) << 2;
+        code |= (y > w) << 3;
+        code |= (z < -w) << 4;
+        code |= (z > w) << 5;
+        code |= (z + w < 0) << 6;
+        code |= (x + gx * w < 0) << 7;
+        code |= (gx * w - x < 0) << 8;
+        code |= (y + gy * w < 0) << 9;
+        code |= (gy * w - y < 0) << 10;
+        codes[k] = code;
+    }
+}
+
+#ifdef CLIP_X86_SIMD
+// Outcode bit b for the lanes set in the comparison mask.
+__attribute__((target("avx2")))
+static inline __m256i outcode_bit_avx2(__m256 mask, int b)
+{
+    return _mm256_and_si256(_mm256_castps_si256(mask), _mm256_set1_epi32(1 << b));
+}
+
+__attribute__((target("avx2")))
+static void outcodes_avx2(const float position[4][VERTEX_BATCH_SIZE], float gx, float gy,
+    int codes[VERTEX_BATCH_SIZE])
+{
+    __m256 x = _mm256_loadu_ps(position[0]);
+    __m256 y = _mm256_loadu_ps(position[1]);
+    __m256 z = _mm256_loadu_ps(position[2]);
+    __m256 w = _mm256_loadu_ps(position[3]);
+    __m256 neg_w = _mm256_xor_ps(w, _mm256_set1_ps(-0.0f));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 gx_w = _mm256_mul_ps(_mm256_set1_ps(gx), w);
+    __m256 gy_w = _mm256_mul_ps(_mm256_set1_ps(gy), w);
+
+    __m256i code = outcode_bit_avx2(_mm256_cmp_ps(x, neg_w, _CMP_LT_OQ), 0);
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(x, w, _CMP_GT_OQ), 1));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(y, neg_w, _CMP_LT_OQ), 2));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(y, w, _CMP_GT_OQ), 3));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(z, neg_w, _CMP_LT_OQ), 4));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(z, w, _CMP_GT_OQ), 5));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(_mm256_add_ps(z, w), zero, _CMP_LT_OQ), 6));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(_mm256_add_ps(x, gx_w), zero, _CMP_LT_OQ), 7));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(_mm256_sub_ps(gx_w, x), zero, _CMP_LT_OQ), 8));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(_mm256_add_ps(y, gy_w), zero, _CMP_LT_OQ), 9));
+    code = _mm256_or_si256(code, outcode_bit_avx2(_mm256_cmp_ps(_mm256_sub_ps(gy_w, y), zero, _CMP_LT_OQ), 10));
+    _mm256_storeu_si256((__m256i*)codes, code);
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i outcode_bit_sse4(__m128 mask, int b)
+{
+    return _mm_and_si128(_mm_castps_si128(mask), _mm_set1_epi32(1 << b));
+}
+
+__attribute__((target("sse4.2")))
+static void outcodes_sse4(const float position[4][VERTEX_BATCH_SIZE], float gx, float gy,
+    int codes[VERTEX_BATCH_SIZE])
+{
+    for(int h = 0; h < VERTEX_BATCH_SIZE; h += 4) {
+        __m128 x = _mm_loadu_ps(position[0] + h);
+        __m128 y = _mm_loadu_ps(position[1] + h);
+        __m128 z = _mm_loadu_ps(position[2] + h);
+        __m128 w = _mm_loadu_ps(position[3] + h);
+        __m128 neg_w = _mm_xor_ps(w, _mm_set1_ps(-0.0f));
+        __m128 zero = _mm_setzero_ps();
+        __m128 gx_w = _mm_mul_ps(_mm_set1_ps(gx), w);
+        __m128 gy_w = _mm_mul_ps(_mm_set1_ps(gy), w);
+
+        __m128i code = outcode_bit_sse4(_mm_cmplt_ps(x, neg_w), 0);
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmpgt_ps(x, w), 1));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(y, neg_w), 2));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmpgt_ps(y, w), 3));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(z, neg_w), 4));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmpgt_ps(z, w), 5));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(_mm_add_ps(z, w), zero), 6));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(_mm_add_ps(x, gx_w), zero), 7));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(_mm_sub_ps(gx_w, x), zero), 8));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(_mm_add_ps(y, gy_w), zero), 9));
+        code = _mm_or_si128(code, outcode_bit_sse4(_mm_cmplt_ps(_mm_sub_ps(gy_w, y), zero), 10));
+        _mm_storeu_si128((__m128i*)(codes + h), code);
+    }
+}
+#endif
+
+typedef void (*outcode_kernel)(const float position[4][VERTEX_BATCH_SIZE], float gx, float gy,
+    int codes[VERTEX_BATCH_SIZE]);
+
+// The fastest kernel supported by the CPU we are running on.
+static outcode_kernel select_outcode_kernel()
+{
+#ifdef CLIP_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) { return outcodes_avx2; }
+    if(__builtin_cpu_supports("sse4.2")) { return outcodes_sse4; }
+#endif
+    return outcodes_scalar;
+}
+
+void batch_outcodes(const float position[4][VERTEX_BATCH_SIZE], int width, int height,
+    int codes[VERTEX_BATCH_SIZE])
+{
+    static const outcode_kernel kernel = select_outcode_kernel();
+    kernel(position, guard_band_scale(width), guard_band_scale(height), codes);
+}
@@ -92,11 +92,60 @@ struct data_output
     // int gl_SampleMask[];
 };
 
+// Number of vertices processed by one call of a batched vertex shader.
+static const int VERTEX_BATCH_SIZE = 8;
+
+// Input of a batched vertex shader: VERTEX_BATCH_SIZE vertices in
+// structure-of-arrays form, where float i of vertex k is
+// data[i*VERTEX_BATCH_SIZE+k].  Only the first count vertices are used; the
+// others are copies of vertex count-1, so every lane may be computed.
+struct data_vertex_batch
+{
+    int count;
+    float * data;
+};
+
+// Output of a batched vertex shader.  Component c of the position of vertex
+// k is gl_Position[c][k].  data is laid out as in data_vertex_batch, and as
+// with data_geometry, it initially holds the input data, so the shader only
+// needs to write the floats it changes.
+struct data_geometry_batch
+{
+    float gl_Position[4][VERTEX_BATCH_SIZE];
+    float * data;
+};
+
+// Number of fragments processed by one call of a packet fragment shader: a
+// span of adjacent pixels on one row.
+static const int FRAGMENT_PACKET_SIZE = 8;
+
+// Input of a packet fragment shader: FRAGMENT_PACKET_SIZE fragments in
+// structure-of-arrays form, where float i of fragment k is
+// data[i*FRAGMENT_PACKET_SIZE+k].  Only the fragments whose bit is set in
+// mask (bit k for fragment k) are covered; the floats of the others may hold
+// any value, and their outputs are ignored.
+struct data_fragment_packet
+{
+    int mask;
+    float * data;
+};
+
+// Output of a packet fragment shader.  Component c of the color of fragment
+// k is output_color[c][k].
+struct data_output_packet
+{
+    float output_color[4][FRAGMENT_PACKET_SIZE];
+};
+
 // Signatures for vertex shaders and fragment shaders.
 typedef void (*shader_v)(const data_vertex&, data_geometry&,const float *);
 
+typedef void (*shader_v_batch)(const data_vertex_batch&, data_geometry_batch&,const float *);
+
 typedef void (*shader_f)(const data_fragment&, data_output&,const float *);
 
+typedef void (*shader_f_packet)(const data_fragment_packet&, data_output_packet&,const float *);
+
 // Different interpolation strategies that may be used to interpolate data from
 // triangle vertices to the pixels (fragments) inside the triangle.
 enum class interp_type {invalid, flat, smooth, noperspective};
@@ -104,4 +153,11 @@ enum class interp_type {invalid, flat, smooth, noperspective};
 // Different layouts for providing triangle data.
 enum class render_type {invalid, indexed, triangle, fan, strip};
 
+// Which triangles are discarded before rasterization, based on whether they
+// face the viewer.
+enum class cull_mode {none, front, back};
+
+// Winding (on screen) of the triangles that face the viewer.
+enum class winding {ccw, cw};
+
 #endif
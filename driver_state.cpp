@@ -1,5 +1,54 @@
 #include "driver_state.h"
+#include "clip.h"
+#include "meshlet.h"
+#include "raster.h"
+#include "ring.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <cstring>
+#include <mutex>
+#include <thread>
+
+// A triangle on its way from the vertex stage to the clip stage: pointers to
+// its shaded vertices, and whether it needs clipping (otherwise it was
+// trivially accepted).
+struct clip_item
+{
+    const data_geometry* v[3];
+    bool clip;
+};
+
+// Number of triangles the queue to the clip stage holds.
+static const int CLIP_QUEUE_SIZE = 1024;
+
+// Number of set-up triangles the queue to the raster stage holds.  These are
+// much larger than clip_items.
+static const int RASTER_QUEUE_SIZE = 64;
+
+// The queues and threads of a pipelined render.  The vertex stage runs on the
+// thread calling render and feeds clip; the clip stage clips and sets up the
+// triangles and feeds raster; the raster stage rasterizes them, or bins them
+// during a tile-binned render.
+struct stage_queues
+{
+    spsc_ring<clip_item> clip{CLIP_QUEUE_SIZE};
+    spsc_ring<triangle_setup> raster{RASTER_QUEUE_SIZE};
+    std::thread clip_thread;
+    std::thread raster_thread;
+
+    // Counters of the raster stage, added to the state's once it is done.
+    driver_stats raster_stats;
+};
+
+static void begin_bins(driver_state& state);
+static void begin_pipeline(driver_state& state);
+static void end_pipeline(driver_state& state);
+static thread_pool& render_pool(driver_state& state);
+static void rasterize_bins(driver_state& state);
+static void begin_deferred(driver_state& state);
+static void resolve_deferred(driver_state& state);
 
 driver_state::driver_state()
 {
@@ -9,6 +58,12 @@ driver_state::~driver_state()
 {
     delete [] image_color;
     delete [] image_depth;
+    delete [] image_hiz;
+    delete [] image_primitive;
+    delete tile_bins;
+    delete deferred_storage;
+    delete stage_storage;
+    delete pool;
 }
 
 // This function should allocate and initialize the arrays that store color and
@@ -25,233 +80,1002 @@ void initialize_render(driver_state& state, int width, int height)
         state.image_color[i] = make_pixel(0, 0, 0); 
 	state.image_depth[i] = 1;
     }
+
+    state.hiz_width = (width + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE;
+    state.hiz_height = (height + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE;
+    state.image_hiz = new float[state.hiz_width * state.hiz_height];
+    for(int i = 0; i < state.hiz_width * state.hiz_height; i++) {
+        state.image_hiz[i] = 1;
+    }
 }
 
-// This function will be called to render the data that has been stored in this class.
-// Valid values of type are:
-//   render_type::triangle - Each group of three vertices corresponds to a triangle.
-//   render_type::indexed -  Each group of three indices in index_data corresponds
-//                           to a triangle.  These numbers are indices into vertex_data.
-//   render_type::fan -      The vertices are to be interpreted as a triangle fan.
-//   render_type::strip -    The vertices are to be interpreted as a triangle strip.
-void render(driver_state& state, render_type type)
+driver_stats& driver_stats::operator += (const driver_stats& s)
 {
-    const data_geometry* out[3];
-    data_geometry g[3];
-    data_vertex v[3];
+    hiz_blocks_culled += s.hiz_blocks_culled;
+    hiz_triangles_culled += s.hiz_triangles_culled;
+    culled_facing += s.culled_facing;
+    culled_degenerate += s.culled_degenerate;
+    culled_no_samples += s.culled_no_samples;
+    clip_trivial_rejects += s.clip_trivial_rejects;
+    clip_trivial_accepts += s.clip_trivial_accepts;
+    clip_triangles_clipped += s.clip_triangles_clipped;
+    vertex_cache_hits += s.vertex_cache_hits;
+    vertex_cache_misses += s.vertex_cache_misses;
+    vertices_shaded += s.vertices_shaded;
+    vertices_welded += s.vertices_welded;
+    meshlets_culled_frustum += s.meshlets_culled_frustum;
+    meshlets_culled_cone += s.meshlets_culled_cone;
+    fragments_shaded += s.fragments_shaded;
+    clip_queue_pushes += s.clip_queue_pushes;
+    clip_queue_occupancy += s.clip_queue_occupancy;
+    clip_queue_full += s.clip_queue_full;
+    clip_queue_empty += s.clip_queue_empty;
+    raster_queue_pushes += s.raster_queue_pushes;
+    raster_queue_occupancy += s.raster_queue_occupancy;
+    raster_queue_full += s.raster_queue_full;
+    raster_queue_empty += s.raster_queue_empty;
+    return *this;
+}
+
+void dump_stats(const driver_state& state, FILE* file)
+{
+    const driver_stats& s = state.stats;
+    fprintf(file, "hiz_blocks_culled: %ld\n", s.hiz_blocks_culled);
+    fprintf(file, "hiz_triangles_culled: %ld\n", s.hiz_triangles_culled);
+    fprintf(file, "culled_facing: %ld\n", s.culled_facing);
+    fprintf(file, "culled_degenerate: %ld\n", s.culled_degenerate);
+    fprintf(file, "culled_no_samples: %ld\n", s.culled_no_samples);
+    fprintf(file, "clip_trivial_rejects: %ld\n", s.clip_trivial_rejects);
+    fprintf(file, "clip_trivial_accepts: %ld\n", s.clip_trivial_accepts);
+    fprintf(file, "clip_triangles_clipped: %ld\n", s.clip_triangles_clipped);
+    fprintf(file, "vertex_cache_hits: %ld\n", s.vertex_cache_hits);
+    fprintf(file, "vertex_cache_misses: %ld\n", s.vertex_cache_misses);
+    fprintf(file, "vertices_shaded: %ld\n", s.vertices_shaded);
+    fprintf(file, "vertices_welded: %ld\n", s.vertices_welded);
+    fprintf(file, "meshlets_culled_frustum: %ld\n", s.meshlets_culled_frustum);
+    fprintf(file, "meshlets_culled_cone: %ld\n", s.meshlets_culled_cone);
+    fprintf(file, "fragments_shaded: %ld\n", s.fragments_shaded);
+    fprintf(file, "clip_queue_pushes: %ld\n", s.clip_queue_pushes);
+    fprintf(file, "clip_queue_average: %.2f\n", s.clip_queue_pushes ? (double)s.clip_queue_occupancy / s.clip_queue_pushes : 0.0);
+    fprintf(file, "clip_queue_full: %ld\n", s.clip_queue_full);
+    fprintf(file, "clip_queue_empty: %ld\n", s.clip_queue_empty);
+    fprintf(file, "raster_queue_pushes: %ld\n", s.raster_queue_pushes);
+    fprintf(file, "raster_queue_average: %.2f\n", s.raster_queue_pushes ? (double)s.raster_queue_occupancy / s.raster_queue_pushes : 0.0);
+    fprintf(file, "raster_queue_full: %ld\n", s.raster_queue_full);
+    fprintf(file, "raster_queue_empty: %ld\n", s.raster_queue_empty);
+}
+
+// Number of vertices shaded by one job of the parallel vertex stage.  A
+// multiple of VERTEX_BATCH_SIZE, so that only the last job has a partial
+// batch.
+static const int VERTEX_JOB_SIZE = 1024;
+
+// Run the vertex shader on vertex index of vertex_data.  The data of the
+// output vertex is stored in shaded_data, and initially holds a copy of the
+// input data, so that shaders only need to write the floats they change.
+static void shade_vertex(driver_state& state, int index, data_geometry& out)
+{
+    data_vertex v;
+    v.data = &state.vertex_data[index * state.floats_per_vertex];
+    out.data = &state.shaded_data[index * state.floats_per_vertex];
+    std::copy(v.data, v.data + state.floats_per_vertex, out.data);
+    state.vertex_shader(v, out, state.uniform_data);
+}
 
+// Compute the outcodes of a batch of shaded vertices from their positions
+// (in structure-of-arrays form, see batch_outcodes), and store them in
+// vertex_outcodes for the count vertices of vertex_data listed in index.
+static void store_outcodes(driver_state& state, const float position[4][VERTEX_BATCH_SIZE],
+    const int* index, int count)
+{
+    int codes[VERTEX_BATCH_SIZE];
+    batch_outcodes(position, state.image_width, state.image_height, codes);
+    for(int k = 0; k < count; k++) {
+        state.vertex_outcodes[index[k]] = codes[k];
+    }
+}
+
+// Run the vertex shader on the count vertices of vertex_data listed in index,
+// storing the results in shaded_vertices and their outcodes in
+// vertex_outcodes.  Vertices are gathered into structure-of-arrays batches for
+// the batched vertex shader, and the data it outputs is scattered into
+// shaded_data, as shade_vertex would leave it.  Shaders without a batched
+// version are called once per vertex instead, and only the positions they
+// output are gathered, for the outcodes.
+static void shade_vertices(driver_state& state, const int* index, int count)
+{
+    if(!state.vertex_shader_batch) {
+        float position[4][VERTEX_BATCH_SIZE];
+        for(int b = 0; b < count; b += VERTEX_BATCH_SIZE) {
+            int n = std::min(VERTEX_BATCH_SIZE, count - b);
+            for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+                data_geometry& g = state.shaded_vertices[index[b + std::min(k, n - 1)]];
+                if(k < n) { shade_vertex(state, index[b + k], g); }
+                for(int i = 0; i < 4; i++) {
+                    position[i][k] = g.gl_Position[i];
+                }
+            }
+            store_outcodes(state, position, &index[b], n);
+        }
+        return;
+    }
+
+    int floats = state.floats_per_vertex;
+    float soa[MAX_FLOATS_PER_VERTEX * VERTEX_BATCH_SIZE];
+    data_vertex_batch in;
+    data_geometry_batch out;
+    in.data = soa;
+    out.data = soa;
+    for(int b = 0; b < count; b += VERTEX_BATCH_SIZE) {
+        in.count = std::min(VERTEX_BATCH_SIZE, count - b);
+        for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+            const float* v = &state.vertex_data[index[b + std::min(k, in.count - 1)] * floats];
+            for(int i = 0; i < floats; i++) {
+                soa[i * VERTEX_BATCH_SIZE + k] = v[i];
+            }
+        }
+
+        state.vertex_shader_batch(in, out, state.uniform_data);
+
+        for(int k = 0; k < in.count; k++) {
+            data_geometry& g = state.shaded_vertices[index[b + k]];
+            g.data = &state.shaded_data[index[b + k] * floats];
+            for(int i = 0; i < floats; i++) {
+                g.data[i] = soa[i * VERTEX_BATCH_SIZE + k];
+            }
+            g.gl_Position = vec4(out.gl_Position[0][k], out.gl_Position[1][k],
+                out.gl_Position[2][k], out.gl_Position[3][k]);
+        }
+        store_outcodes(state, out.gl_Position, &index[b], in.count);
+    }
+}
+
+// List the vertices to shade in vertex_list: for an indexed draw, each vertex
+// of the visible triangles once, in order of first use; otherwise all of them.
+static void list_vertices(driver_state& state, render_type type)
+{
+    std::vector<int>& list = state.vertex_list;
+    list.clear();
+    if(type != render_type::indexed) {
+        for(int i = 0; i < state.num_vertices; i++) {
+            list.push_back(i);
+        }
+        return;
+    }
+    state.vertex_used.assign(state.num_vertices, 0);
+    for(int i = 0; i < 3 * state.num_triangles; i++) {
+        if(!state.triangle_visible[i / 3]) { continue; }
+        int index = state.index_data[i];
+        if(state.vertex_used[index]) {
+            state.stats.vertex_cache_hits++;
+        } else {
+            state.stats.vertex_cache_misses++;
+            list.push_back(index);
+            state.vertex_used[index] = list.size();
+        }
+    }
+}
+
+// Shade the vertices in vertex_list into shaded_vertices.  If
+// parallel_vertices is set, the vertices are shaded by all threads.
+static void vertex_stage(driver_state& state)
+{
+    const std::vector<int>& list = state.vertex_list;
+    state.stats.vertices_shaded += list.size();
+    if(state.parallel_vertices && state.num_threads > 1 && list.size() > VERTEX_JOB_SIZE) {
+        // The listed vertices are distinct, so the jobs write disjoint
+        // entries of shaded_vertices and shaded_data.
+        int count = list.size();
+        render_pool(state).parallel_for((count + VERTEX_JOB_SIZE - 1) / VERTEX_JOB_SIZE, [&](int job) {
+            int first = job * VERTEX_JOB_SIZE;
+            shade_vertices(state, &list[first], std::min(VERTEX_JOB_SIZE, count - first));
+        });
+    } else {
+        shade_vertices(state, list.data(), list.size());
+    }
+}
+
+// Call emit(a, b, c) with the vertex indices (into vertex_data) of each
+// triangle of the draw, in order.  Triangles of indexed draws culled by
+// meshlet are skipped.
+template<class F>
+static void for_each_triangle(const driver_state& state, render_type type, F emit)
+{
     switch(type) {
         case render_type::triangle: {
-	   int beg = 0;
-	   for(int i = 0; i < state.num_vertices; i += 3) {
-		for(int j = 0; j < 3; j++) {			
-		    v[j].data = &state.vertex_data[beg];
-		    g[j].data = v[j].data;
-		    state.vertex_shader(v[j], g[j], state.uniform_data);
-		    out[j] = &g[j];
-		    beg += state.floats_per_vertex;
-		}
-		clip_triangle(state, out, 0);
+	   for(int i = 0; i + 2 < state.num_vertices; i += 3) {
+		emit(i, i + 1, i + 2);
 	    }
 	    break;
 	}
 	case render_type::indexed: {
 	    for(int i = 0; i < 3 * state.num_triangles; i += 3) {
-		for(int j = 0; j < 3; j++) {
-		    v[j].data = &state.vertex_data[state.index_data[i + j] * state.floats_per_vertex];
-		    g[j].data = v[j].data;
-		    state.vertex_shader(v[j], g[j], state.uniform_data);
-		    out[j] = &g[j];
-		}
-		clip_triangle(state, out, 0);
+		if(!state.triangle_visible[i / 3]) { continue; }
+		emit(state.index_data[i], state.index_data[i + 1], state.index_data[i + 2]);
 	    }
 	    break;
 	}
 	case render_type::fan: {
-	    for(int i = 0; i < state.num_vertices; i++) {
-		for(int j = 0; j < 3; j++) {
-		    int index = i + j;
-		    if(j == 0) { index = 0; }
-		    v[j].data = &state.vertex_data[index * state.floats_per_vertex];
-		    g[j].data = v[j].data;
-		    state.vertex_shader(v[j], g[j], state.uniform_data);
-		    out[j] = &g[j];
-		}
-		clip_triangle(state, out, 0);
+	    // triangles (0, i, i+1)
+	    for(int i = 1; i < state.num_vertices - 1; i++) {
+		emit(0, i, i + 1);
 	    }
 	    break;
 	}
 	case render_type::strip: {
+	    // Triangles (i, i+1, i+2).  Every other triangle has its last two
+	    // vertices swapped so that all triangles have the same winding; the
+	    // first vertex (which flat floats come from) is unchanged.
 	    for(int i = 0; i < state.num_vertices - 2; i++) {
-		for(int j = 0; j < 3; j++) {
-		    v[j].data = &state.vertex_data[(i + j) * state.floats_per_vertex];
-		    g[j].data = v[j].data;
-		    state.vertex_shader(v[j], g[j], state.uniform_data);
-		    out[j] = & g[j];
-		}
-		clip_triangle(state, out, 0);
+		emit(i, i + 1 + i % 2, i + 2 - i % 2);
 	    }
 	    break;
 	}
 	default:
 	    break;
     }    
+}
 
+// What happens to a triangle in the clip stage: it is discarded, passed to
+// the rasterizer as is, or clipped.
+enum class clip_class {reject, accept, clip};
+
+// Classify the triangle with vertices a, b and c (indices into vertex_data)
+// by the outcodes of its vertices: a triangle entirely outside one of the six
+// planes of the view volume is discarded, and a triangle inside the near
+// plane and the guard band goes straight to the rasterizer, which only visits
+// pixels inside the image.  Only the remaining triangles are clipped
+// geometrically.  There is no need to clip against the far plane: fragments
+// beyond it have depth > 1 and fail the depth test.
+static clip_class classify_triangle(driver_state& state, int a, int b, int c)
+{
+    const int* codes = state.vertex_outcodes.data();
+    int all = codes[a] & codes[b] & codes[c];
+    int any = codes[a] | codes[b] | codes[c];
+    if(all & OUTCODE_VIEW) {
+        state.stats.clip_trivial_rejects++;
+        return clip_class::reject;
+    }
+    if(!(any & OUTCODE_CLIP)) {
+        state.stats.clip_trivial_accepts++;
+        return clip_class::accept;
+    }
+    state.stats.clip_triangles_clipped++;
+    return clip_class::clip;
+}
+
+// Assemble the triangles of the draw from shaded_vertices and pass them on to
+// clipping, or straight to the rasterizer if they need none.
+static void assemble_triangles(driver_state& state, render_type type)
+{
+    const data_geometry* shaded = state.shaded_vertices.data();
+    for_each_triangle(state, type, [&](int a, int b, int c) {
+        clip_class k = classify_triangle(state, a, b, c);
+        if(k == clip_class::reject) { return; }
+        const data_geometry* out[3] = { &shaded[a], &shaded[b], &shaded[c] };
+        if(k == clip_class::accept) { rasterize_triangle(state, out); }
+        else { clip_triangle(state, out, 0); }
+    });
+}
+
+// The vertex stage of a pipelined render: shade the vertices in vertex_list
+// and push the assembled triangles to the clip stage, except those that are
+// trivially rejected.  The vertices are shaded
+// in order, VERTEX_JOB_SIZE at a time, as the triangles come to need them, so
+// that the clip stage can start on the first triangles while the rest of the
+// vertices are being shaded.  Returns once the clip stage has taken every
+// triangle, since the next instance overwrites shaded_vertices.
+static void feed_pipeline(driver_state& state, render_type type)
+{
+    stage_queues& queues = *state.queues;
+    const std::vector<int>& list = state.vertex_list;
+    const data_geometry* shaded = state.shaded_vertices.data();
+    state.stats.vertices_shaded += list.size();
+
+    // Number of vertices of list shaded so far.  A vertex is shaded once
+    // the first rank(v) vertices of list are.
+    int done = 0;
+    bool indexed = type == render_type::indexed;
+    auto rank = [&](int v) { return indexed ? state.vertex_used[v] : v + 1; };
+    for_each_triangle(state, type, [&](int a, int b, int c) {
+        int needed = std::max(std::max(rank(a), rank(b)), rank(c));
+        if(needed > done) {
+            int end = std::min<int>(std::max(needed, done + VERTEX_JOB_SIZE), list.size());
+            shade_vertices(state, &list[done], end - done);
+            done = end;
+        }
+        clip_class k = classify_triangle(state, a, b, c);
+        if(k == clip_class::reject) { return; }
+        clip_item* item = queues.clip.wait_back(state.stats.clip_queue_full);
+        item->v[0] = &shaded[a];
+        item->v[1] = &shaded[b];
+        item->v[2] = &shaded[c];
+        item->clip = k == clip_class::clip;
+        state.stats.clip_queue_pushes++;
+        state.stats.clip_queue_occupancy += queues.clip.size();
+        queues.clip.push();
+    });
+    queues.clip.wait_empty();
+}
+
+// This function will be called to render the data that has been stored in this class.
+// Valid values of type are:
+//   render_type::triangle - Each group of three vertices corresponds to a triangle.
+//   render_type::indexed -  Each group of three indices in index_data corresponds
+//                           to a triangle.  These numbers are indices into vertex_data.
+//   render_type::fan -      The vertices are to be interpreted as a triangle fan.
+//   render_type::strip -    The vertices are to be interpreted as a triangle strip.
+// The vertex stage runs first: every vertex used by the draw is shaded once,
+// into shaded_vertices, and the triangles are then assembled from there.  An
+// instanced draw repeats both for every instance, with the uniform data of
+// the instance.  Meshlets of indexed draws are culled before the vertex
+// stage, and the vertices and triangles of culled meshlets are skipped.
+// The rasterizer pipeline is chosen once per render, based on the vertex_data
+// layout.  With more than one thread, the clipped triangles are binned into
+// screen tiles and the tiles are rasterized in parallel once all triangles have
+// been binned.  Temporary storage comes from state.arena, which is reset here,
+// so a render does not allocate once the arena and bins have grown to size.
+// A pipelined render runs the clip and raster stages on threads of their own
+// (see stage_queues), overlapping with the vertex stage.  A deferred render
+// (see raster_deferred) shades the pixels once all triangles have been
+// rasterized.
+void render(driver_state& state, render_type type)
+{
+    state.pipeline = &select_raster_pipeline(state);
+    state.arena.reset();
+    state.fragment_data = state.arena.alloc(MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE);
+    if(state.num_threads > 1) { begin_bins(state); }
+    if(state.pipelined) { begin_pipeline(state); }
+    if(state.visibility_buffer) { begin_deferred(state); }
+
+    // Indexed draws whose vertex shader applies the uniform transform to the
+    // vertex positions are split into meshlets, which can be culled as a
+    // whole before any vertex is shaded.
+    bool meshlets = type == render_type::indexed && state.vertex_shader_transform;
+    if(meshlets) { build_meshlets(state); }
+    if(type == render_type::indexed) { state.triangle_visible.resize(state.num_triangles); }
+
+    state.shaded_vertices.resize(state.num_vertices);
+    state.shaded_data.resize(state.num_vertices * state.floats_per_vertex);
+    state.vertex_outcodes.resize(state.num_vertices);
+
+    float* uniform_data = state.uniform_data;
+    for(int instance = 0; instance < state.num_instances; instance++) {
+        if(state.instance_uniform_data) {
+            state.uniform_data = state.instance_uniform_data + instance * state.instance_uniform_size;
+        }
+        if(state.pipeline->constant_color) { state.constant_color = state.pipeline->constant_color(state.uniform_data); }
+        if(type == render_type::indexed) {
+            std::fill(state.triangle_visible.begin(), state.triangle_visible.end(), 1);
+            if(meshlets && state.uniform_data) { cull_meshlets(state); }
+        }
+        list_vertices(state, type);
+        if(state.queues) {
+            feed_pipeline(state, type);
+        } else {
+            vertex_stage(state);
+            assemble_triangles(state, type);
+        }
+    }
+    state.uniform_data = uniform_data;
+
+    if(state.queues) { end_pipeline(state); }
+    if(state.bins) { rasterize_bins(state); }
+    if(state.deferred) { resolve_deferred(state); }
 }
 
 
+// Signed distance of p to clip plane face; negative outside.  The outcode
+// kernels (clip_simd.cpp) evaluate the same expressions.
+static float clip_distance(const driver_state& state, const vec4& p, int face)
+{
+    float gx = guard_band_scale(state.image_width);
+    float gy = guard_band_scale(state.image_height);
+    switch(face) {
+        case 0: return p[2] + p[3];
+        case 1: return p[0] + gx * p[3];
+        case 2: return gx * p[3] - p[0];
+        case 3: return p[1] + gy * p[3];
+        default: return gy * p[3] - p[1];
+    }
+}
+
+// Create the vertex where the edge from a to b crosses a clip plane, given
+// the signed distances da >= 0 > db (or the reverse) of a and b to the plane.
+// Smooth floats are linear in clip coordinates; noperspective floats are
+// linear on screen, so they use the parameter of the crossing along the
+// projected edge.  Flat floats are copied from provoke, the first vertex of
+// the triangle being clipped.
+static void clip_vertex(driver_state& state, const data_geometry& a, const data_geometry& b,
+    float da, float db, const data_geometry& provoke, data_geometry& out)
+{
+    float t = da / (da - db);
+    out.gl_Position = a.gl_Position + t * (b.gl_Position - a.gl_Position);
+    out.data = state.arena.alloc(state.floats_per_vertex);
+
+    float wa = a.gl_Position[3], wb = b.gl_Position[3];
+    float t_screen = t * wb / (wa + t * (wb - wa));
+    for(int i = 0; i < state.floats_per_vertex; i++) {
+        switch(state.interp_rules[i]) {
+            case interp_type::flat:
+                out.data[i] = provoke.data[i];
+                break;
+            case interp_type::smooth:
+                out.data[i] = a.data[i] + t * (b.data[i] - a.data[i]);
+                break;
+            case interp_type::noperspective:
+                out.data[i] = a.data[i] + t_screen * (b.data[i] - a.data[i]);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
 // This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
+// It will be called recursively, once for each clipping face (face=0, 1, ...,
+// CLIP_PLANES-1) to clip against each of the clipping faces in turn.  When
+// face=CLIP_PLANES, clip_triangle simply passes the call on to
+// rasterize_triangle.
+//
+// Triangles are classified by the outcodes of their vertices before they get
+// here (see classify_triangle), so only triangles that straddle a clip plane
+// are clipped.
 void clip_triangle(driver_state& state, const data_geometry* in[3],int face)
 {
-    if(face == 1)
+    if(face == CLIP_PLANES)
     {
         rasterize_triangle(state, in);
         return;
     }
-    
-    vec4 a = in[0]->gl_Position;
-    vec4 b = in[1]->gl_Position;
-    vec4 c = in[2]->gl_Position;
-    const data_geometry *input[3] = { in[0], in[1], in[2] };
-    data_geometry new_vertex0[3];
-    data_geometry new_vertex1[3];
-    float alpha0, alpha1, alpha_prime;
-    vec4 p0, p1;
-
-    if(a[2] <= -a[3] && b[2] <= -b[3] && c[2] <= -c[3]) { return; }
-    else 
-	if(a[2] <= -a[3] && b[2] > -b[3] && c[2] > -c[3]) {
-	    alpha0 = (-b[3] - b[2]) / (a[2] + a[3] - b[3] - b[2]);
-	    alpha1 = (-a[3] - a[2]) / (c[2] + c[3] - a[3] - a[2]);
-	    p0 = alpha0 * a + (1 - alpha0) * b;
-	    p1 = alpha1 * c + (1 - alpha1) * a;
-
-	    new_vertex0[0].data = new float[state.floats_per_vertex];
-	    new_vertex0[1] = *in[1];
-	    new_vertex0[2] = *in[2];
-
-	    for(int i = 0; i < state.floats_per_vertex; i++) {
-		switch(state.interp_rules[i]) {
-		    case interp_type::flat:
-			new_vertex0[0].data[i] = in[0]->data[i];
-			break;
-		    case interp_type::smooth:
-			new_vertex0[0].data[i] = alpha1 * in[2]->data[i] + (1 - alpha1) * in[0]->data[i];
-			break;
-		    case interp_type::noperspective:
-			alpha_prime = alpha1 * in[2]->gl_Position[3] / (alpha1 * in[2]->gl_Position[3] + (1 - alpha1) * in[0]->gl_Position[3]);
-			new_vertex0[0].data[i] = alpha_prime * in[2]->data[i] + (1 - alpha_prime) * in[0]->data[i];
-			break;
-		    default:
-			break;
-		}
-	    }
- 
-	    new_vertex0[0].gl_Position = p1;
-	    input[0] = &new_vertex0[0];
-	    input[1] = &new_vertex0[1];
-	    input[2] = &new_vertex0[2];
-
-	    clip_triangle(state, input, face + 1);
-
-	    new_vertex1[0].data = new float[state.floats_per_vertex];
-
-	    for(int i = 0; i < state.floats_per_vertex; i++) 
-		switch(state.interp_rules[i]) {
-		    case interp_type::flat:
-			new_vertex1[0].data[i] = in[0]->data[i];
-			break;
-		    case interp_type::smooth:
-			new_vertex1[0].data[i] = alpha0 * in[0]->data[i] + (1 - alpha0) * in[1]->data[i];
-			break;
-		    case interp_type::noperspective:
-			alpha_prime = alpha0 * in[0]->gl_Position[3] / (alpha0 * in[0]->gl_Position[3] * (1 - alpha0) * in[1]->gl_Position[3]);
-			new_vertex1[0].data[i] = alpha_prime * in[0]->data[i] + (1 - alpha_prime) * in[1]->data[i];
-			break;
-		    default:
-			break;
-		}
-	    
-	    new_vertex1[0].gl_Position = p0;
-	    input[0] = &new_vertex1[0];
-	    input[1] = &new_vertex0[1];
-	    input[2] = &new_vertex0[0];
-	
-	}
-	
-	clip_triangle(state, input, face + 1);
 
+    float dist[3];
+    int inside = 0;
+    for(int n = 0; n < 3; n++) {
+        dist[n] = clip_distance(state, in[n]->gl_Position, face);
+        if(dist[n] >= 0) { inside++; }
+    }
+    if(inside == 0) { return; }
+    if(inside == 3) {
+        clip_triangle(state, in, face + 1);
+        return;
+    }
+
+    // The vertices created here are only needed until the clipped triangles
+    // have been rasterized (or set up for binning), so their data is given
+    // back to the arena on return.
+    draw_arena::position arena_mark = state.arena.mark();
+
+    // Rotate the triangle (keeping its winding) so that vertex k is the one
+    // on its own side of the plane, then clip edges k,k+1 and k+2,k.
+    int k = 0;
+    for(int n = 0; n < 3; n++) {
+        if((dist[n] >= 0) == (inside == 1)) { k = n; }
+    }
+    const data_geometry& v0 = *in[k];
+    const data_geometry& v1 = *in[(k + 1) % 3];
+    const data_geometry& v2 = *in[(k + 2) % 3];
+    float d0 = dist[k], d1 = dist[(k + 1) % 3], d2 = dist[(k + 2) % 3];
+
+    data_geometry p01, p20;
+    clip_vertex(state, v0, v1, d0, d1, *in[0], p01);
+    clip_vertex(state, v2, v0, d2, d0, *in[0], p20);
+
+    // Clipped triangles start with a new vertex, so that they take their
+    // flat floats from the first vertex of the original triangle.
+    if(inside == 1) {
+        const data_geometry* tri[3] = { &p01, &p20, &v0 };
+        clip_triangle(state, tri, face + 1);
+    } else {
+        const data_geometry* tri0[3] = { &p01, &v1, &v2 };
+        const data_geometry* tri1[3] = { &p20, &p01, &v2 };
+        clip_triangle(state, tri0, face + 1);
+        clip_triangle(state, tri1, face + 1);
+    }
+
+    state.arena.rewind(arena_mark);
+}
+
+// Number of fractional bits in the fixed-point (subpixel) vertex positions used
+// by the rasterizer.  Vertex positions are snapped to 1/256 of a pixel.
+static const int SUBPIXEL_BITS = 8;
+static const long long SUBPIXEL_ONE = 1LL << SUBPIXEL_BITS;
+
+// Largest magnitude a snapped vertex coordinate may have.  This keeps every
+// product in the edge function setup comfortably inside a 64-bit integer.
+static const long long MAX_FIXED_COORD = 1LL << 29;
+
+// Triangles whose bounding box has at most this many pixels are checked for
+// coverage during setup, so that triangles covering no pixel centers can be
+// culled before their planes are set up.
+static const int SMALL_TRIANGLE_PIXELS = 4;
+
+// Build the edge function for the directed edge from vertex (x0,y0) to vertex
+// (x1,y1), where the triangle is counterclockwise (positive area).
+static void setup_edge(edge_function& e, long long x0, long long y0, long long x1, long long y1)
+{
+    long long dx = x1 - x0;
+    long long dy = y1 - y0;
+    e.a = -dy * SUBPIXEL_ONE;
+    e.b = dx * SUBPIXEL_ONE;
+    e.c = dy * x0 - dx * y0;
+
+    // With y pointing up and counterclockwise winding, the interior lies to
+    // the left of each edge.  Left edges point down; top edges are horizontal
+    // and point in the -x direction.
+    bool top_left = dy < 0 || (dy == 0 && dx < 0);
+    e.min_inside = top_left ? 0 : 1;
+}
+
+// Snap the triangle to fixed point and compute its edge functions, bounding
+// box and attribute planes.  This is also where the cull stage runs, since
+// it needs the snapped signed area.  Returns false if the triangle is culled,
+// covers no pixel centers or cannot be rasterized (vertices outside the
+// fixed-point range).
+static bool setup_triangle(driver_state& state, const data_geometry* in[3], triangle_setup& s)
+{
+    // convert to pixel coordinates (i,j), with pixel centers at integers
+    const data_geometry* tri[3] = { in[0], in[1], in[2] };
+    long long fx[3], fy[3];
+    for(int n = 0; n < 3; n++) {
+        float i = state.image_width / 2.0 * (in[n]->gl_Position[0] / in[n]->gl_Position[3]) + state.image_width / 2.0 - 0.5;
+        float j = state.image_height / 2.0 * (in[n]->gl_Position[1] / in[n]->gl_Position[3]) + state.image_height / 2.0 - 0.5;
+
+        // Reject vertices that cannot be represented in fixed point; this
+        // also catches NaNs and infinities from vertices with w == 0.
+        if(!(std::abs(i) < MAX_FIXED_COORD / SUBPIXEL_ONE) || !(std::abs(j) < MAX_FIXED_COORD / SUBPIXEL_ONE)) { return false; }
+        fx[n] = std::llround(i * SUBPIXEL_ONE);
+        fy[n] = std::llround(j * SUBPIXEL_ONE);
+    }
+
+    // twice the signed area, in subpixel units.  Positive if the triangle is
+    // counterclockwise on screen (with y pointing up).
+    long long area = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fy[1] - fy[0]) * (fx[2] - fx[0]);
+    if(area == 0) {
+        state.stats.culled_degenerate++;
+        return false;
+    }
+
+    // Cull stage: discard the triangle if it faces the culled direction.
+    bool front = (area > 0) == (state.front_face == winding::ccw);
+    if((state.cull == cull_mode::back && !front) || (state.cull == cull_mode::front && front)) {
+        state.stats.culled_facing++;
+        return false;
+    }
+
+    // Make the winding counterclockwise.
+    if(area < 0) {
+        std::swap(tri[1], tri[2]);
+        std::swap(fx[1], fx[2]);
+        std::swap(fy[1], fy[2]);
+        area = -area;
+    }
+
+    setup_edge(s.edge[0], fx[1], fy[1], fx[2], fy[2]);
+    setup_edge(s.edge[1], fx[2], fy[2], fx[0], fy[0]);
+    setup_edge(s.edge[2], fx[0], fy[0], fx[1], fy[1]);
+    for(int n = 0; n < 3; n++) {
+        for(int i = 0; i < RASTER_BLOCK_SIZE; i++) {
+            s.lane_edge[n][i] = i * s.edge[n].a;
+        }
+    }
+
+    long long min_fx = std::min(std::min(fx[0], fx[1]), fx[2]);
+    long long max_fx = std::max(std::max(fx[0], fx[1]), fx[2]);
+    long long min_fy = std::min(std::min(fy[0], fy[1]), fy[2]);
+    long long max_fy = std::max(std::max(fy[0], fy[1]), fy[2]);
+    s.min_x = std::max<long long>((min_fx + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS, 0);
+    s.min_y = std::max<long long>((min_fy + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS, 0);
+    s.max_x = std::min<long long>(max_fx >> SUBPIXEL_BITS, state.image_width - 1);
+    s.max_y = std::min<long long>(max_fy >> SUBPIXEL_BITS, state.image_height - 1);
+    if(s.min_x > s.max_x || s.min_y > s.max_y) {
+        state.stats.culled_no_samples++;
+        return false;
+    }
+
+    // A thin triangle can have a nonempty bounding box yet miss every pixel
+    // center in it.  For tiny boxes it is cheaper to test each pixel here
+    // than to set up the planes and visit a block.
+    if((s.max_x - s.min_x + 1) * (s.max_y - s.min_y + 1) <= SMALL_TRIANGLE_PIXELS) {
+        bool covered = false;
+        for(int y = s.min_y; y <= s.max_y && !covered; y++) {
+            for(int x = s.min_x; x <= s.max_x && !covered; x++) {
+                covered = true;
+                for(int n = 0; n < 3; n++) {
+                    const edge_function& e = s.edge[n];
+                    if(e.a * x + e.b * y + e.c < e.min_inside) { covered = false; }
+                }
+            }
+        }
+        if(!covered) {
+            state.stats.culled_no_samples++;
+            return false;
+        }
+    }
+
+    // Barycentric coordinates at the origin and their change per pixel in x
+    // and y.  The edge values at the origin are exact, so the planes are
+    // accurate near the triangle even if the edge constants are large.
+    s.origin_x = s.min_x;
+    s.origin_y = s.min_y;
+    s.uniform_data = state.uniform_data;
+    s.color = state.constant_color;
+    float inv_area = 1.0f / area;
+    float bary[3][3];
+    for(int n = 0; n < 3; n++) {
+        bary[0][n] = (s.edge[n].a * s.origin_x + s.edge[n].b * s.origin_y + s.edge[n].c) * inv_area;
+        bary[1][n] = s.edge[n].a * inv_area;
+        bary[2][n] = s.edge[n].b * inv_area;
+    }
+
+    float k[3], inv_w[3];
+    for(int n = 0; n < 3; n++) {
+        inv_w[n] = 1 / tri[n]->gl_Position[3];
+        k[n] = tri[n]->gl_Position[2] * inv_w[n];
+    }
+    setup_plane(s.depth, bary, k);
+
+    state.pipeline->setup_varyings(state, tri, bary, inv_w, s);
+    if(s.num_smooth) { setup_plane(s.inv_w, bary, inv_w); }
+    return true;
+}
+
+// Offsets from the origin pixel of a size x size block to the pixels where
+// the edge function attains its minimum (lo) and maximum (hi) over the block.
+static void edge_extent(const edge_function& e, int size, long long& lo, long long& hi)
+{
+    long long last = size - 1;
+    lo = std::min(e.a, 0LL) * last + std::min(e.b, 0LL) * last;
+    hi = std::max(e.a, 0LL) * last + std::max(e.b, 0LL) * last;
+}
+
+// Smallest depth the triangle can produce at a pixel of the block whose origin
+// is (bx,by), minus a bound on the rounding error in the kernels' evaluation
+// of the depth plane.  Used for the hierarchical z-buffer test, which must
+// never reject a pixel that would pass the depth test.
+static float block_min_depth(const triangle_setup& s, int bx, int by)
+{
+    const attribute_plane& p = s.depth;
+    float x = bx - s.origin_x, y = by - s.origin_y;
+    float last = RASTER_BLOCK_SIZE - 1;
+    float d = plane_at(p, s, bx, by) + std::min(p.dx, 0.0f) * last + std::min(p.dy, 0.0f) * last;
+    float error = 8 * FLT_EPSILON * (std::abs(p.c) + std::abs(p.dx) * (std::abs(x) + last) + std::abs(p.dy) * (std::abs(y) + last));
+    return d - error;
+}
+
+// Recompute the hierarchical z-buffer entry of the block whose origin is
+// (bx,by) from the depths stored in the block.
+static void update_hiz(driver_state& state, int bx, int by)
+{
+    int x1 = std::min(bx + RASTER_BLOCK_SIZE, state.image_width);
+    int y1 = std::min(by + RASTER_BLOCK_SIZE, state.image_height);
+    float farthest = state.image_depth[bx + by * state.image_width];
+    for(int y = by; y < y1; y++) {
+        const float* depth = state.image_depth + y * state.image_width;
+        for(int x = bx; x < x1; x++) {
+            farthest = std::max(farthest, depth[x]);
+        }
+    }
+    state.image_hiz[bx / RASTER_BLOCK_SIZE + by / RASTER_BLOCK_SIZE * state.hiz_width] = farthest;
+}
+
+// Rasterize the part of the (already set up) triangle that lies within the
+// pixel rectangle min_x..max_x, min_y..max_y.  The rectangle must be aligned
+// to blocks, except where it is clipped by the triangle's bounding box.
+//
+// The rectangle is walked in RASTER_BLOCK_SIZE square blocks.  Each edge
+// function is evaluated at the corner of the block where it is smallest and
+// where it is largest: a block that is outside any edge is skipped, a block
+// inside all three edges is filled without per-pixel inside tests, and only
+// blocks straddling an edge are tested pixel by pixel.  Blocks that are
+// entirely behind the depths already stored (according to the hierarchical
+// z-buffer) are skipped as well.  Each row of a block is handed to a pixel
+// kernel, which is vectorized across the row when the CPU supports it.
+// Counters are added to stats.
+static void rasterize_blocks(driver_state& state, const triangle_setup& s,
+    int min_x, int min_y, int max_x, int max_y, data_fragment_packet& frag, driver_stats& stats)
+{
+    const raster_pipeline& pipeline = *state.pipeline;
+    const edge_function* edge = s.edge;
+
+    min_x = std::max(min_x, s.min_x);
+    min_y = std::max(min_y, s.min_y);
+    max_x = std::min(max_x, s.max_x);
+    max_y = std::min(max_y, s.max_y);
+
+    long long lo[3], hi[3];
+    for(int n = 0; n < 3; n++) {
+        edge_extent(edge[n], RASTER_BLOCK_SIZE, lo[n], hi[n]);
+    }
+    for(int f = 0; f < s.num_flat && !state.deferred && !pipeline.constant_color; f++) {
+        for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+            frag.data[s.flat_index[f] * FRAGMENT_PACKET_SIZE + k] = s.flat_value[f];
+        }
+    }
+
+    // during a deferred render, only store the visible primitives
+    raster_row_kernel vector_kernel = pipeline.vector_kernel, scalar_kernel = pipeline.scalar_kernel;
+    if(state.deferred) {
+        vector_kernel = pipeline.vector_visibility_kernel;
+        scalar_kernel = pipeline.scalar_visibility_kernel;
+    }
+
+    int block_x0 = min_x - min_x % RASTER_BLOCK_SIZE;
+    int block_y0 = min_y - min_y % RASTER_BLOCK_SIZE;
+    int blocks_touched = 0, blocks_culled = 0;
+    for(int by = block_y0; by <= max_y; by += RASTER_BLOCK_SIZE) {
+        for(int bx = block_x0; bx <= max_x; bx += RASTER_BLOCK_SIZE) {
+            raster_row row;
+            bool outside = false;
+            row.inside = true;
+            for(int n = 0; n < 3; n++) {
+                row.e[n] = edge[n].a * bx + edge[n].b * by + edge[n].c;
+                if(row.e[n] + hi[n] < edge[n].min_inside) { outside = true; }
+                if(row.e[n] + lo[n] < edge[n].min_inside) { row.inside = false; }
+            }
+            if(outside) { continue; }
+
+            blocks_touched++;
+            int block = bx / RASTER_BLOCK_SIZE + by / RASTER_BLOCK_SIZE * state.hiz_width;
+            float farthest = state.image_hiz[block];
+            if(!(block_min_depth(s, bx, by) < farthest)) {
+                blocks_culled++;
+                continue;
+            }
+
+            // part of the block that lies within the rectangle
+            row.bx = bx;
+            row.x0 = std::max(bx, min_x);
+            row.x1 = std::min(bx + RASTER_BLOCK_SIZE - 1, max_x);
+            int y0 = std::max(by, min_y);
+            int y1 = std::min(by + RASTER_BLOCK_SIZE - 1, max_y);
+
+            // the vector kernels access whole rows, which must fit in the image
+            raster_row_kernel kernel = bx + RASTER_BLOCK_SIZE <= state.image_width ? vector_kernel : scalar_kernel;
+            for(int n = 0; n < 3; n++) {
+                row.e[n] += edge[n].b * (y0 - by);
+            }
+            int written = 0, shaded = 0;
+            for(row.y = y0; row.y <= y1; row.y++) {
+                int passed = kernel(state, s, row, frag);
+                written |= passed;
+                shaded += __builtin_popcount(passed);
+                for(int n = 0; n < 3; n++) {
+                    row.e[n] += edge[n].b;
+                }
+            }
+            if(written) { update_hiz(state, bx, by); }
+            if(!state.deferred) { stats.fragments_shaded += shaded; }
+            else if(written) { state.deferred->blocks[block] = 1; }
+        }
+    }
+
+    stats.hiz_blocks_culled += blocks_culled;
+    if(blocks_touched && blocks_culled == blocks_touched) { stats.hiz_triangles_culled++; }
+}
+
+// Add a set-up triangle to every tile it may touch.  Tiles whose corners lie
+// outside one of the edges are skipped, just like blocks during
+// rasterization.
+static void bin_triangle(driver_state& state, const triangle_setup& s)
+{
+    raster_bins& bins = *state.bins;
+    int id = bins.triangles.size();
+    bins.triangles.push_back(s);
+
+    long long lo[3], hi[3];
+    for(int n = 0; n < 3; n++) {
+        edge_extent(s.edge[n], RASTER_TILE_SIZE, lo[n], hi[n]);
+    }
+    for(int ty = s.min_y / RASTER_TILE_SIZE; ty <= s.max_y / RASTER_TILE_SIZE; ty++) {
+        for(int tx = s.min_x / RASTER_TILE_SIZE; tx <= s.max_x / RASTER_TILE_SIZE; tx++) {
+            bool outside = false;
+            for(int n = 0; n < 3; n++) {
+                long long e = s.edge[n].a * tx * RASTER_TILE_SIZE + s.edge[n].b * ty * RASTER_TILE_SIZE + s.edge[n].c;
+                if(e + hi[n] < s.edge[n].min_inside) { outside = true; }
+            }
+            if(!outside) { bins.tiles[tx + ty * bins.tiles_x].push_back(id); }
+        }
+    }
+}
+
+// The pool of state.num_threads threads used by the parallel stages, created
+// on first use.
+static thread_pool& render_pool(driver_state& state)
+{
+    if(!state.pool) { state.pool = new thread_pool(state.num_threads); }
+    return *state.pool;
+}
+
+// Start a tile-binned render: triangles passed to rasterize_triangle are
+// collected in bins until rasterize_bins is called.  The bins of the previous
+// render are emptied but keep their capacity.
+static void begin_bins(driver_state& state)
+{
+    if(!state.tile_bins) { state.tile_bins = new raster_bins; }
+    raster_bins& bins = *state.tile_bins;
+    bins.tiles_x = (state.image_width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    bins.tiles_y = (state.image_height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    bins.tiles.resize(bins.tiles_x * bins.tiles_y);
+    bins.triangles.clear();
+    for(size_t i = 0; i < bins.tiles.size(); i++) {
+        bins.tiles[i].clear();
+    }
+    state.bins = &bins;
+}
+
+// Rasterize a set-up triangle, or bin it during a tile-binned render.  During
+// a deferred render the triangle is stored first, as the primitive the first
+// pass writes to image_primitive.
+static void draw_triangle(driver_state& state, triangle_setup& s, data_fragment_packet& frag,
+    driver_stats& stats)
+{
+    if(state.deferred) {
+        s.primitive = state.deferred->triangles.size();
+        state.deferred->triangles.push_back(s);
+    }
+    if(state.bins) {
+        bin_triangle(state, s);
+    } else {
+        rasterize_blocks(state, s, s.min_x, s.min_y, s.max_x, s.max_y, frag, stats);
+    }
+}
+
+// Start a deferred render: the triangles of the previous render are
+// forgotten, but keep their capacity.
+static void begin_deferred(driver_state& state)
+{
+    if(!state.deferred_storage) { state.deferred_storage = new raster_deferred; }
+    if(!state.image_primitive) {
+        state.image_primitive = new int[state.image_width * state.image_height];
+        std::fill(state.image_primitive, state.image_primitive + state.image_width * state.image_height, -1);
+    }
+    raster_deferred& deferred = *state.deferred_storage;
+    deferred.triangles.clear();
+    deferred.blocks.assign(state.hiz_width * state.hiz_height, 0);
+    state.deferred = &deferred;
+}
+
+// The second pass of a deferred render: shade the pixels of the blocks the
+// first pass wrote to, one row of blocks per job.  Each pixel is shaded once,
+// with the triangle visible there, which leaves the image identical to that
+// of a forward render.
+static void resolve_deferred(driver_state& state)
+{
+    raster_deferred& deferred = *state.deferred;
+    const raster_pipeline& pipeline = *state.pipeline;
+
+    std::mutex stats_mutex;
+    auto resolve = [&](int block_y) {
+        float data[MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE];
+        data_fragment_packet frag{0, data};
+        long shaded = 0;
+        int y1 = std::min((block_y + 1) * RASTER_BLOCK_SIZE, state.image_height);
+        for(int block_x = 0; block_x < state.hiz_width; block_x++) {
+            char& written = deferred.blocks[block_x + block_y * state.hiz_width];
+            if(!written) { continue; }
+            written = 0;
+            for(int y = block_y * RASTER_BLOCK_SIZE; y < y1; y++) {
+                shaded += pipeline.resolve_row(state, block_x * RASTER_BLOCK_SIZE, y, frag);
+            }
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        state.stats.fragments_shaded += shaded;
+    };
+    if(state.num_threads > 1) {
+        render_pool(state).parallel_for(state.hiz_height, resolve);
+    } else {
+        for(int block_y = 0; block_y < state.hiz_height; block_y++) { resolve(block_y); }
+    }
+    state.deferred = 0;
+}
+
+// Rasterize the binned triangles, one tile per job.  Each tile is owned by a
+// single thread and its triangles are drawn in submission order, so the
+// result is identical to rasterizing the triangles immediately.
+static void rasterize_bins(driver_state& state)
+{
+    raster_bins& bins = *state.bins;
+    state.bins = 0;
+
+    std::mutex stats_mutex;
+    render_pool(state).parallel_for(bins.tiles.size(), [&](int tile) {
+        float data[MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE];
+        data_fragment_packet frag{0, data};
+        driver_stats stats;
+        int x0 = tile % bins.tiles_x * RASTER_TILE_SIZE;
+        int y0 = tile / bins.tiles_x * RASTER_TILE_SIZE;
+        const std::vector<int>& list = bins.tiles[tile];
+        for(size_t i = 0; i < list.size(); i++) {
+            rasterize_blocks(state, bins.triangles[list[i]], x0, y0,
+                x0 + RASTER_TILE_SIZE - 1, y0 + RASTER_TILE_SIZE - 1, frag, stats);
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        state.stats += stats;
+    });
+}
+
+// The clip stage of a pipelined render: clip (if needed) and set up the
+// triangles pushed by the vertex stage.  rasterize_triangle pushes the set-up triangles on to
+// the raster stage.  Its counters go to state.stats; they are disjoint from
+// those the vertex stage updates meanwhile.
+static void clip_stage(driver_state& state)
+{
+    stage_queues& queues = *state.queues;
+    while(clip_item* item = queues.clip.wait_front(state.stats.clip_queue_empty)) {
+        if(item->clip) { clip_triangle(state, item->v, 0); }
+        else { rasterize_triangle(state, item->v); }
+        queues.clip.pop();
+    }
+    queues.raster.close();
+}
+
+// The raster stage of a pipelined render: rasterize the set-up triangles in
+// the order they arrive, or bin them during a tile-binned render.
+static void raster_stage(driver_state& state)
+{
+    stage_queues& queues = *state.queues;
+    driver_stats& stats = queues.raster_stats;
+    float data[MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE];
+    data_fragment_packet frag{0, data};
+    while(triangle_setup* s = queues.raster.wait_front(stats.raster_queue_empty)) {
+        draw_triangle(state, *s, frag, stats);
+        queues.raster.pop();
+    }
+}
+
+// Start the clip and raster stages of a pipelined render.  Until
+// end_pipeline, the triangles of the render go through the queues, and only
+// the clip stage may use state.arena.
+static void begin_pipeline(driver_state& state)
+{
+    if(!state.stage_storage) { state.stage_storage = new stage_queues; }
+    stage_queues& queues = *state.stage_storage;
+    queues.clip.reset();
+    queues.raster.reset();
+    queues.raster_stats = driver_stats();
+    state.queues = &queues;
+    queues.clip_thread = std::thread(clip_stage, std::ref(state));
+    queues.raster_thread = std::thread(raster_stage, std::ref(state));
+}
+
+// Wait for the clip and raster stages to finish the triangles pushed so far,
+// and stop them.
+static void end_pipeline(driver_state& state)
+{
+    stage_queues& queues = *state.queues;
+    queues.clip.close();
+    queues.clip_thread.join();
+    queues.raster_thread.join();
+    state.stats += queues.raster_stats;
+    state.queues = 0;
 }
 
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
 // function is responsible for rasterization, interpolation of data to
 // fragments, calling the fragment shader, and z-buffering.
+//
+// The triangle is set up once: vertex positions are snapped to fixed point and
+// the three edge functions are computed exactly in integer arithmetic, and
+// the plane equations of depth and of the interpolated floats are computed.
+// During a tile-binned render the triangle is only binned here, and
+// rasterized later by rasterize_bins.  During a pipelined render it is set up
+// here, on the clip stage's thread, and handed to the raster stage.
 void rasterize_triangle(driver_state& state, const data_geometry* in[3])
 {
-   // convert to NDC coordinates (i,j)
-   float i[3], j[3], k[3];
-   for(int n = 0; n < 3; n++) {	
-	i[n] = state.image_width / 2.0 * (in[n]->gl_Position[0] / in[n]->gl_Position[3]) + state.image_width / 2.0 - 0.5;
-	j[n] = state.image_height / 2.0 * (in[n]->gl_Position[1] / in[n]->gl_Position[3]) + state.image_height / 2.0 - 0.5;
-	k[n] = in[n]->gl_Position[2] / in[n]->gl_Position[3];
-   }
-
-   float min_i = std::min(std::min(i[0],i[1]),i[2]);
-   float max_i = std::max(std::max(i[0],i[1]),i[2]);
-   float min_j = std::min(std::min(j[0],j[1]),j[2]);
-   float max_j = std::max(std::max(j[0],j[1]),j[2]);
-
-   if(min_i < 0) { min_i = 0; } 
-   if(min_j < 0) { min_j = 0; }
-   if(max_i > state.image_width) { max_i = state.image_width; }
-   if(max_j > state.image_height) { max_j = state.image_height; }
-
-   float area = 0.5 * ((i[1] * j[2] - i[2] * j[1]) - (i[0] * j[2] - i[2] * j[0]) + (i[0] * j[1] - i[1] * j[0]));
-   float alpha, beta, gamma = 0.0;
- 
-   float* data = new float[MAX_FLOATS_PER_VERTEX];
-   data_fragment frag{data};
-   data_output out;
-   float temp, depth, alpha_prime, beta_prime, gamma_prime = 0.0;
-  
-   for(int x = min_i; x < max_i; x++) {
-       for(int y = min_j; y < max_j; y++) {
-           alpha = 0.5 * ((i[1] * j[2] - i[2] * j[1]) + (j[1] - j[2]) * x + (i[2] - i[1]) * y) / area;
-	   beta = 0.5 * ((i[2] * j[0] - i[0] * j[2]) + (j[2] - j[0]) * x + (i[0] - i[2]) * y) / area;
-	   gamma = 0.5 * ((i[0] * j[1] - i[1] * j[0]) + (j[0] - j[1]) * x + (i[1] - i[0]) * y) / area;
-
-           if(alpha >= 0 && beta >= 0 && gamma >= 0) {      
-	       //depth = alpha * (in[0]->gl_Position[2] / in[0]->gl_Position[3]) + beta * (in[1]->gl_Position[2] / in[1]->gl_Position[3]) + gamma * (in[2]->gl_Position[2] / in[2]->gl_Position[3]);
-	       depth = alpha * k[0] + beta * k[1] + gamma * k[2];
-	       if(state.image_depth[x + y * state.image_width] > depth) {
-	           for(int z = 0; z < state.floats_per_vertex; z++) {
-	               switch(state.interp_rules[z]) {
-	                   case interp_type::flat:
-		               frag.data[z] = in[0]->data[z];
-		               break;
-		           case interp_type::smooth:
-		               temp = alpha / in[0]->gl_Position[3] + beta / in[1]->gl_Position[3] + gamma / in[2]->gl_Position[3]; 
-			       alpha_prime = alpha / (temp * in[0]->gl_Position[3]);
-			       beta_prime = beta / (temp * in[1]->gl_Position[3]);
-			       gamma_prime = gamma / (temp * in[2]->gl_Position[3]);
-			       frag.data[z] = alpha_prime * in[0]->data[z] + beta_prime * in[1]->data[z] + gamma_prime * in[2]->data[z];
-			       break;
-		           case interp_type::noperspective:
-			       frag.data[z] = alpha * in[0]->data[z] + beta * in[1]->data[z] + gamma * in[2]->data[z];
-		               break;
-		           default:
-		               break;
-	               }
-	           }
-
-	           state.fragment_shader(frag, out, state.uniform_data);
-	           state.image_color[x + y * state.image_width] = make_pixel(out.output_color[0] * 255, out.output_color[1] * 255, out.output_color[2] * 255);
-		    state.image_depth[x + y * state.image_width] = depth;
-	       }
-	   }   
-       }
-   }  
+    if(state.queues) {
+        stage_queues& queues = *state.queues;
+        triangle_setup* slot = queues.raster.wait_back(state.stats.raster_queue_full);
+        if(!setup_triangle(state, in, *slot)) { return; }
+        state.stats.raster_queue_pushes++;
+        state.stats.raster_queue_occupancy += queues.raster.size();
+        queues.raster.push();
+        return;
+    }
+
+    triangle_setup s;
+    if(!setup_triangle(state, in, s)) { return; }
+
+    data_fragment_packet frag{0, state.fragment_data};
+    draw_triangle(state, s, frag, state.stats);
 }
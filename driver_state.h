@@ -2,6 +2,76 @@
 #define __DRIVER__
 
 #include "common.h"
+#include "arena.h"
+#include "meshlet.h"
+#include <cstdio>
+#include <vector>
+
+class thread_pool;
+struct raster_bins;
+struct raster_deferred;
+struct raster_pipeline;
+struct shader_program;
+struct stage_queues;
+
+// Counters collected while rendering, reported in the statistics output.
+struct driver_stats
+{
+    // Blocks of triangles rejected by the hierarchical z-buffer, and
+    // triangles for which every block was rejected.  With tile binning, a
+    // triangle is counted once for every tile in which it was rejected.
+    long hiz_blocks_culled = 0;
+    long hiz_triangles_culled = 0;
+
+    // Triangles discarded by the cull stage: because of the direction they
+    // face, because they have zero area, or because they cover no pixel
+    // centers.
+    long culled_facing = 0;
+    long culled_degenerate = 0;
+    long culled_no_samples = 0;
+
+    // Triangles entirely outside the view volume, triangles that needed no
+    // clipping, and triangles that were clipped against the near plane or
+    // the guard band.
+    long clip_trivial_rejects = 0;
+    long clip_trivial_accepts = 0;
+    long clip_triangles_clipped = 0;
+
+    // Vertex references of indexed draws that reused an already shaded
+    // vertex, and those that had to run the vertex shader.
+    long vertex_cache_hits = 0;
+    long vertex_cache_misses = 0;
+
+    // Vertex shader calls, for all types of draws.
+    long vertices_shaded = 0;
+
+    // Duplicate vertices removed by welding triangle draws.
+    long vertices_welded = 0;
+
+    // Fragments passed to the fragment shader.
+    long fragments_shaded = 0;
+
+    // Meshlets culled for being outside the view volume, and for facing
+    // the culled direction.
+    long meshlets_culled_frustum = 0;
+    long meshlets_culled_cone = 0;
+
+    // Pipelined renders: for the queue of triangles feeding the clip stage
+    // and the queue of set-up triangles feeding the raster stage, the items
+    // pushed, the sum of the queue lengths seen by each push (so that the
+    // ratio is the average occupancy), the pushes that waited for a full
+    // queue, and the pops that waited for an empty one.
+    long clip_queue_pushes = 0;
+    long clip_queue_occupancy = 0;
+    long clip_queue_full = 0;
+    long clip_queue_empty = 0;
+    long raster_queue_pushes = 0;
+    long raster_queue_occupancy = 0;
+    long raster_queue_full = 0;
+    long raster_queue_empty = 0;
+
+    driver_stats& operator += (const driver_stats& s);
+};
 
 struct driver_state
 {
@@ -30,6 +100,14 @@ struct driver_state
     // to supply the pointer when necessary.
     float * uniform_data = 0;
 
+    // Number of times render() draws the geometry.  If instance_uniform_data
+    // is set, instance i uses the instance_uniform_size floats starting at
+    // instance_uniform_data + i*instance_uniform_size as its uniform data, in
+    // place of uniform_data.
+    int num_instances = 1;
+    float * instance_uniform_data = 0;
+    int instance_uniform_size = 0;
+
     // Vertex data (such as color) at the vertices of triangles must be
     // interpolated to each pixel (fragment) within the triangle before calling
     // the fragment shader.  Since there are floats_per_vertex floats stored per
@@ -44,6 +122,12 @@ struct driver_state
     //                                 barycentric coordinates.
     interp_type interp_rules[MAX_FLOATS_PER_VERTEX] = {};
 
+    // Triangles that face the viewer have front_face winding on screen.
+    // Triangles facing the direction given by cull are discarded before
+    // rasterization.
+    cull_mode cull = cull_mode::none;
+    winding front_face = winding::ccw;
+
     // Image dimensions
     int image_width = 0;
     int image_height = 0;
@@ -58,12 +142,38 @@ struct driver_state
     // size and layout is the same as image_color.
     float * image_depth = 0;
 
+    // Hierarchical z-buffer: the farthest depth stored in image_depth within
+    // each of the rasterizer's square blocks.  Blocks are stored row by row,
+    // hiz_width blocks per row.  A block of a triangle whose nearest depth is
+    // not in front of this depth cannot pass the depth test and is skipped.
+    float * image_hiz = 0;
+    int hiz_width = 0;
+    int hiz_height = 0;
+
+    // Visibility buffer: the primitive (see triangle_setup) of the triangle
+    // visible at each pixel during a deferred render, or -1.  The size and
+    // layout is the same as image_color.  Allocated by the first deferred
+    // render, and all -1 between renders.
+    int * image_primitive = 0;
+
+    driver_stats stats;
+
     // Pointer to a function, which performs the role of a vertex shader.  It
     // should be called on each vertex and given data stored in vertex_data.
     // This routine also receives the uniform data.
     void (*vertex_shader)(const data_vertex& in, data_geometry& out,
         const float * uniform_data);
 
+    // Batched version of vertex_shader, which shades VERTEX_BATCH_SIZE
+    // vertices per call, or null if it has none.  If set, it is used instead
+    // of vertex_shader.
+    shader_v_batch vertex_shader_batch = 0;
+
+    // Set if vertex_shader computes gl_Position as the mat4 in the first 16
+    // uniform floats times the position in the first 3 floats of the vertex.
+    // Such draws can be culled by meshlet.
+    bool vertex_shader_transform = false;
+
     // Pointer to a function, which performs the role of a fragment shader.  It
     // should be called for each pixel (fragment) within each triangle.  The
     // fragment shader should be given interpolated vertex data (interpolated
@@ -71,6 +181,98 @@ struct driver_state
     void (*fragment_shader)(const data_fragment& in, data_output& out,
         const float * uniform_data);
 
+    // Packet version of fragment_shader, which shades FRAGMENT_PACKET_SIZE
+    // fragments per call, or null if it has none.  If set, it is used instead
+    // of fragment_shader.
+    shader_f_packet fragment_shader_packet = 0;
+
+    // Fragment shader defined in the scene file, bound to the draw's uniform
+    // data, or null.  If set, it is used instead of fragment_shader.
+    shader_program * fragment_program = 0;
+
+    // Number of threads used for rendering.  With more than one thread,
+    // render() bins the clipped triangles into screen tiles and the tiles are
+    // rasterized in parallel, each tile by a single thread.
+    int num_threads = 1;
+    thread_pool * pool = 0;
+
+    // Shade the vertices of a draw on all num_threads threads, rather than
+    // on the calling thread only.  The vertex shaders must then be safe to
+    // call concurrently.
+    bool parallel_vertices = false;
+
+    // Run the vertex, clip and raster stages of each render on their own
+    // threads, connected by bounded queues, rather than one triangle at a
+    // time on the calling thread.
+    bool pipelined = false;
+
+    // Queues between the stages during a pipelined render; null otherwise.
+    // Points to stage_storage, which is kept between renders.
+    stage_queues * queues = 0;
+    stage_queues * stage_storage = 0;
+
+    // Render in two passes: the first only finds the triangle visible at each
+    // pixel, in image_primitive, and the second shades each of those pixels
+    // once, so that no fragment is shaded only to be overwritten.
+    bool visibility_buffer = false;
+
+    // The triangles of a deferred render; null otherwise.  Points to
+    // deferred_storage, which is kept between renders.
+    raster_deferred * deferred = 0;
+    raster_deferred * deferred_storage = 0;
+
+    // Turn triangle draws into indexed draws when they are loaded, storing
+    // each distinct vertex once.
+    bool weld_vertices = false;
+
+    // Triangles binned so far during a tile-binned render; null otherwise.
+    // Points to tile_bins, which is kept between renders so that the bins
+    // keep their capacity.
+    raster_bins * bins = 0;
+    raster_bins * tile_bins = 0;
+
+    // Storage whose lifetime is one render call, such as the data of
+    // vertices created by clipping.  Reset at the start of every render.
+    draw_arena arena;
+
+    // Fragment data of a packet (MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE
+    // floats, from arena) used when triangles are rasterized immediately.
+    float * fragment_data = 0;
+
+    // Post-transform vertex buffer: shaded_vertices[i] is the output of the
+    // vertex shader for vertex i of vertex_data, if vertex i is in
+    // vertex_list, the vertices used by the current draw.  For an indexed
+    // draw, vertex_used[i] is one plus the position of vertex i in
+    // vertex_list, or 0 if it is not used.  Kept between renders so that they
+    // keep their capacity.
+    std::vector<data_geometry> shaded_vertices;
+    std::vector<int> vertex_list;
+    std::vector<int> vertex_used;
+
+    // Output data of the vertex shader, floats_per_vertex floats per vertex
+    // of vertex_data; the data of shaded_vertices points into it.
+    std::vector<float> shaded_data;
+
+    // Outcodes of the shaded vertices (see clip.h), computed a batch at a
+    // time by the vertex stage.  Triangles are classified for clipping from
+    // the outcodes of their vertices.
+    std::vector<int> vertex_outcodes;
+
+    // Meshlets of the current indexed draw (see meshlet.h), and which of its
+    // triangles survived meshlet culling for the current instance.
+    std::vector<meshlet> meshlets;
+    std::vector<int> meshlet_triangles;
+    std::vector<char> triangle_visible;
+    meshlet_scratch meshlet_build;
+
+    // Rasterizer setup and kernels for the current draw, specialized for its
+    // vertex_data layout if possible.  Selected at the start of render().
+    const raster_pipeline * pipeline = 0;
+
+    // The color of every fragment of the current draw (or instance), if its
+    // fragment shader ignores its input; see raster_pipeline::constant_color.
+    pixel constant_color = 0;
+
     driver_state();
     ~driver_state();
 };
@@ -80,6 +282,9 @@ struct driver_state
 // constructed.
 void initialize_render(driver_state& state, int width, int height);
 
+// Write the counters in state.stats to file, one "name: value" per line.
+void dump_stats(const driver_state& state, FILE* file);
+
 // This function will be called to render the data that has been stored in this class.
 // Valid values of type are:
 //   render_type::triangle - Each group of three vertices corresponds to a triangle.
@@ -89,10 +294,12 @@ void initialize_render(driver_state& state, int width, int height);
 //   render_type::strip -    The vertices are to be interpreted as a triangle strip.
 void render(driver_state& state, render_type type);
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against the near plane and a guard band around the image, and passes the
+// pieces on to rasterize_triangle.  It calls itself recursively with
+// increasing face, once for each clipping plane.  Triangles that are outside
+// the view volume, or need no clipping, are sorted out by outcode before
+// this is called.
 void clip_triangle(driver_state& state, const data_geometry* in[3],int face=0);
 
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
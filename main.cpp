@@ -3,10 +3,11 @@
  * -------------------------------
  * This is simple testbed for your GLSL implementation.
  *
- * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]
+ * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <threads> ] [ -v ] [ -w ] [ -p ] [ -d ]
  *     <input-file>      File with commands to run
  *     <solution-file>   File with solution to compare with
  *     <stats-file>      Dump statistics to this file rather than stdout
+ *     <threads>         Number of threads to rasterize with (default 1)
  *
  * Only the -i is manditory.  You must specify a test to run.  For example:
  *
@@ -24,6 +25,24 @@
  *
  * The -o flag is used for the grading script, so that grading will not be
  * confused by debug print statements.
+ *
+ * With -t greater than 1, triangles are binned into screen tiles and the tiles
+ * are rasterized in parallel.  The result is identical to a single-threaded
+ * render.  With -v as well, the vertices of large draws are also shaded in
+ * parallel.
+ *
+ * With -w, identical vertices of triangle draws are welded together when the
+ * draw is loaded, and the draw is rendered as an indexed draw.  The result is
+ * identical, but each distinct vertex is only shaded once.
+ *
+ * With -p, the vertex, clip and raster stages of each render run on threads
+ * of their own, connected by bounded queues, so that they overlap.  The result
+ * is identical; the occupancy of the queues is reported in the statistics.
+ *
+ * With -d, each render first finds the triangle visible at every pixel and
+ * then shades each of those pixels once (a visibility buffer), rather than
+ * shading every fragment that passes the depth test.  The result is
+ * identical.
  */
 #include <cassert>
 #include <climits>
@@ -99,10 +118,15 @@ void compare(driver_state& state, FILE* stats_file, const char* solution_file)
 // Provide assistance in calling this program
 void Usage(const char* prog_name)
 {
-    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]"<<std::endl;
+    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <threads> ] [ -v ] [ -w ] [ -p ] [ -d ]"<<std::endl;
     std::cerr<<"    <input-file>      File with commands to run"<<std::endl;
     std::cerr<<"    <solution-file>   File with solution to compare with"<<std::endl;
     std::cerr<<"    <stats-file>      Dump statistics to this file rather than stdout"<<std::endl;
+    std::cerr<<"    <threads>         Number of threads to rasterize with (default 1)"<<std::endl;
+    std::cerr<<"    -v                Shade vertices on all threads too"<<std::endl;
+    std::cerr<<"    -w                Weld identical vertices of triangle draws"<<std::endl;
+    std::cerr<<"    -p                Run the clip and raster stages on threads of their own"<<std::endl;
+    std::cerr<<"    -d                Shade each pixel once, after finding the visible triangles"<<std::endl;
     exit(EXIT_FAILURE);
 }
 
@@ -117,13 +141,18 @@ int main(int argc, char** argv)
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:o:");
+        int opt = getopt(argc, argv, "s:i:o:t:vwpd");
         if(opt==-1) break;
         switch(opt)
         {
             case 's': solution_file = optarg; break;
             case 'i': input_file = optarg; break;
             case 'o': statistics_file = optarg; break;
+            case 't': state.num_threads = atoi(optarg); break;
+            case 'v': state.parallel_vertices = true; break;
+            case 'w': state.weld_vertices = true; break;
+            case 'p': state.pipelined = true; break;
+            case 'd': state.visibility_buffer = true; break;
         }
     }
 
@@ -133,6 +162,11 @@ int main(int argc, char** argv)
         std::cerr<<"Test file required.  Use -i."<<std::endl;
         Usage(argv[0]);
     }
+    if(state.num_threads < 1)
+    {
+        std::cerr<<"Thread count must be at least 1."<<std::endl;
+        Usage(argv[0]);
+    }
 
     // Parse the input file, setup state, request renders
     parse(input_file, state);
@@ -144,6 +178,10 @@ int main(int argc, char** argv)
     if(solution_file)
         compare(state, stats_file, solution_file);
 
+    // Report the rendering counters after the diff, which the grading script
+    // expects on the first line.
+    dump_stats(state, stats_file);
+
     // Save the computed solution to file
     dump_png(state.image_color,state.image_width,state.image_height,"output.png");
 
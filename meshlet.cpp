@@ -0,0 +1,225 @@
+#include "meshlet.h"
+#include "driver_state.h"
+#include <algorithm>
+#include <cmath>
+
+typedef vec<double,3> dvec3;
+
+// Relative safety margin of the culling tests.  A meshlet is only culled if
+// it is outside by more than this fraction of the magnitudes involved, so
+// that rounding in the vertex shader and clipper cannot disagree with it.
+static const double MESHLET_EPSILON = 1e-5;
+
+static dvec3 position(const driver_state& state, int v)
+{
+    const float* p = &state.vertex_data[v * state.floats_per_vertex];
+    return dvec3(p[0], p[1], p[2]);
+}
+
+static bool same_position(const dvec3& a, const dvec3& b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+// Compute the bounding sphere and normal cone of meshlet m.
+static void meshlet_bounds(const driver_state& state, meshlet& m)
+{
+    const int* tri = &state.meshlet_triangles[m.first];
+    const int* index = state.index_data;
+
+    dvec3 lo = position(state, index[3 * tri[0]]), hi = lo;
+    for(int t = 0; t < m.count; t++) {
+        for(int j = 0; j < 3; j++) {
+            dvec3 p = position(state, index[3 * tri[t] + j]);
+            lo = componentwise_min(lo, p);
+            hi = componentwise_max(hi, p);
+        }
+    }
+    dvec3 center = (lo + hi) * 0.5;
+    double radius = 0;
+    for(int t = 0; t < m.count; t++) {
+        for(int j = 0; j < 3; j++) {
+            radius = std::max(radius, (position(state, index[3 * tri[t] + j]) - center).magnitude());
+        }
+    }
+    m.center = vec3(center);
+    m.radius = radius * (1 + MESHLET_EPSILON) + MESHLET_EPSILON * center.magnitude();
+
+    // Triangles with two equal positions have exactly zero area on screen
+    // and are always culled, so they do not constrain the cone.  Any other
+    // triangle without a usable normal does.
+    dvec3 sum;
+    m.has_cone = true;
+    for(int t = 0; t < m.count && m.has_cone; t++) {
+        dvec3 p0 = position(state, index[3 * tri[t]]);
+        dvec3 p1 = position(state, index[3 * tri[t] + 1]);
+        dvec3 p2 = position(state, index[3 * tri[t] + 2]);
+        dvec3 n = cross(p1 - p0, p2 - p0);
+        if(n.magnitude_squared() > 0) { sum += n.normalized(); }
+        else if(!same_position(p0, p1) && !same_position(p1, p2) && !same_position(p2, p0)) { m.has_cone = false; }
+    }
+    if(!m.has_cone || !(sum.magnitude_squared() > 0)) {
+        m.has_cone = false;
+        return;
+    }
+    dvec3 axis = sum.normalized();
+    double cos_min = 1;
+    for(int t = 0; t < m.count; t++) {
+        dvec3 p0 = position(state, index[3 * tri[t]]);
+        dvec3 n = cross(position(state, index[3 * tri[t] + 1]) - p0, position(state, index[3 * tri[t] + 2]) - p0);
+        if(n.magnitude_squared() > 0) { cos_min = std::min(cos_min, dot(n.normalized(), axis)); }
+    }
+    cos_min -= MESHLET_EPSILON;
+    m.has_cone = cos_min > 0;
+    m.cone_axis = vec3(axis);
+    m.cone_cos = cos_min;
+    m.cone_sin = std::sqrt(1 - std::min(cos_min * cos_min, 1.0));
+}
+
+void build_meshlets(driver_state& state)
+{
+    int num_triangles = state.num_triangles;
+    int num_vertices = state.num_vertices;
+    const int* index = state.index_data;
+
+    // triangles using each vertex
+    meshlet_scratch& scratch = state.meshlet_build;
+    std::vector<int>& offset = scratch.offset;
+    std::vector<int>& adjacency = scratch.adjacency;
+    std::vector<int>& fill = scratch.fill;
+    offset.assign(num_vertices + 1, 0);
+    for(int i = 0; i < 3 * num_triangles; i++) offset[index[i] + 1]++;
+    for(int v = 0; v < num_vertices; v++) offset[v + 1] += offset[v];
+    adjacency.resize(offset[num_vertices]);
+    fill.assign(offset.begin(), offset.end());
+    for(int i = 0; i < 3 * num_triangles; i++) adjacency[fill[index[i]]++] = i / 3;
+
+    // Grow each meshlet breadth first from the first unassigned triangle.
+    // queued[t] is the meshlet that t was last queued for.
+    state.meshlets.clear();
+    state.meshlet_triangles.clear();
+    std::vector<char>& assigned = scratch.assigned;
+    std::vector<int>& queued = scratch.queued;
+    std::vector<int>& queue = scratch.queue;
+    assigned.assign(num_triangles, 0);
+    queued.assign(num_triangles, -1);
+    for(int seed = 0; seed < num_triangles; seed++) {
+        if(assigned[seed]) continue;
+        meshlet m;
+        int id = state.meshlets.size();
+        m.first = state.meshlet_triangles.size();
+        m.count = 0;
+        queue.clear();
+        queue.push_back(seed);
+        queued[seed] = id;
+        for(size_t q = 0; q < queue.size() && m.count < MESHLET_MAX_TRIANGLES; q++) {
+            int t = queue[q];
+            assigned[t] = 1;
+            state.meshlet_triangles.push_back(t);
+            m.count++;
+            for(int j = 0; j < 3; j++) {
+                int v = index[3 * t + j];
+                for(int a = offset[v]; a < offset[v + 1]; a++) {
+                    int u = adjacency[a];
+                    if(assigned[u] || queued[u] == id) continue;
+                    queued[u] = id;
+                    queue.push_back(u);
+                }
+            }
+        }
+        meshlet_bounds(state, m);
+        state.meshlets.push_back(m);
+    }
+}
+
+// Largest value of dot(n, v) over the unit vectors n in the cone with the
+// given axis and half-angle (cos_a, sin_a).
+static double cone_max_dot(const dvec3& axis, double cos_a, double sin_a, const dvec3& v)
+{
+    double len = v.magnitude();
+    if(len == 0) return 0;
+    double cos_t = std::max(-1.0, std::min(1.0, dot(axis, v) / len));
+    double sin_t = std::sqrt(1 - cos_t * cos_t);
+    if(cos_t >= cos_a) return len;
+    return len * (cos_t * cos_a + sin_t * sin_a);
+}
+
+void cull_meshlets(driver_state& state)
+{
+    const float* M = state.uniform_data;
+    double r[4][4];
+    for(int i = 0; i < 4; i++) {
+        for(int j = 0; j < 4; j++) {
+            r[i][j] = M[4 * i + j];
+        }
+    }
+
+    // The view volume in object space: clip coordinates are r[i].(p,1), so
+    // plane k is planes[k].(p,1) >= 0.
+    double planes[6][4];
+    for(int j = 0; j < 4; j++) {
+        for(int k = 0; k < 3; k++) {
+            planes[2 * k][j] = r[3][j] + r[k][j];
+            planes[2 * k + 1][j] = r[3][j] - r[k][j];
+        }
+    }
+
+    // The homogeneous eye point: e.(r[0],r[1],r[3]) = 0, computed as the
+    // cofactors of the rows r[0], r[1], r[3], so that e.X = det[r0;r1;r3;X].
+    // For a triangle with counterclockwise normal n through point p, twice
+    // its signed area on screen is -n.(e_xyz - e_w p)/(w0 w1 w2).
+    double e[4];
+    const double* rows[3] = { r[0], r[1], r[3] };
+    for(int k = 0; k < 4; k++) {
+        int c[3], n = 0;
+        for(int j = 0; j < 4; j++) if(j != k) c[n++] = j;
+        double minor = rows[0][c[0]] * (rows[1][c[1]] * rows[2][c[2]] - rows[1][c[2]] * rows[2][c[1]])
+            - rows[0][c[1]] * (rows[1][c[0]] * rows[2][c[2]] - rows[1][c[2]] * rows[2][c[0]])
+            + rows[0][c[2]] * (rows[1][c[0]] * rows[2][c[1]] - rows[1][c[1]] * rows[2][c[0]]);
+        e[k] = (k % 2 ? 1 : -1) * minor;
+    }
+    dvec3 e_xyz(e[0], e[1], e[2]);
+
+    for(size_t i = 0; i < state.meshlets.size(); i++) {
+        const meshlet& m = state.meshlets[i];
+        dvec3 c(m.center);
+        double radius = m.radius;
+
+        bool outside = false;
+        for(int k = 0; k < 6 && !outside; k++) {
+            dvec3 n(planes[k][0], planes[k][1], planes[k][2]);
+            double dist = dot(n, c) + planes[k][3];
+            double len = n.magnitude();
+            double margin = MESHLET_EPSILON * (len * c.magnitude() + std::abs(planes[k][3]) + len * radius);
+            outside = dist + len * radius < -margin;
+        }
+        bool culled = outside;
+        if(outside) {
+            state.stats.meshlets_culled_frustum++;
+        } else if(state.cull != cull_mode::none && m.has_cone) {
+            // The facing test needs w > 0 everywhere in the sphere.
+            dvec3 n_w(r[3][0], r[3][1], r[3][2]);
+            double w = dot(n_w, c) + r[3][3];
+            double w_margin = MESHLET_EPSILON * (n_w.magnitude() * (c.magnitude() + radius) + std::abs(r[3][3]));
+            if(w - n_w.magnitude() * radius > w_margin) {
+                // n.(e_xyz - e_w p) = n.v + e_w n.(c - p), with v = e_xyz - e_w c.
+                dvec3 v = e_xyz - e[3] * c;
+                double spread = std::abs(e[3]) * radius;
+                double margin = MESHLET_EPSILON * (e_xyz.magnitude() + std::abs(e[3]) * (c.magnitude() + radius));
+                dvec3 axis(m.cone_axis);
+                bool all_ccw = cone_max_dot(axis, m.cone_cos, m.cone_sin, v) + spread < -margin;
+                bool all_cw = cone_max_dot(-axis, m.cone_cos, m.cone_sin, v) + spread < -margin;
+                bool ccw_front = state.front_face == winding::ccw;
+                bool all_front = ccw_front ? all_ccw : all_cw;
+                bool all_back = ccw_front ? all_cw : all_ccw;
+                culled = (state.cull == cull_mode::back && all_back) || (state.cull == cull_mode::front && all_front);
+                if(culled) { state.stats.meshlets_culled_cone++; }
+            }
+        }
+        if(culled) {
+            for(int t = 0; t < m.count; t++) {
+                state.triangle_visible[state.meshlet_triangles[m.first + t]] = 0;
+            }
+        }
+    }
+}
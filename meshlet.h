@@ -0,0 +1,58 @@
+#ifndef __MESHLET__
+#define __MESHLET__
+
+#include "vec.h"
+#include <vector>
+
+struct driver_state;
+
+// Maximum number of triangles in a meshlet.
+static const int MESHLET_MAX_TRIANGLES = 128;
+
+// A small cluster of neighboring triangles of an indexed draw, with bounds
+// that allow the whole cluster to be culled at once.  The triangles are
+// meshlet_triangles[first] .. meshlet_triangles[first+count-1] (indices of
+// triangles in index_data).  All positions are in object space, before the
+// vertex shader's transform.
+struct meshlet
+{
+    int first, count;
+
+    // Bounding sphere of the vertices.
+    vec3 center;
+    float radius;
+
+    // Normal cone: every (unnormalized, counterclockwise) triangle normal
+    // makes an angle of at most acos(cone_cos) with cone_axis.  has_cone is
+    // false if the normals are too spread out to bound this way.
+    bool has_cone;
+    vec3 cone_axis;
+    float cone_cos, cone_sin;
+};
+
+// Scratch space of build_meshlets, kept in driver_state between renders so
+// that it keeps its capacity: the triangles using each vertex (adjacency,
+// indexed by offset, filled through fill), and the state of the breadth
+// first search that grows each meshlet.
+struct meshlet_scratch
+{
+    std::vector<int> offset, adjacency, fill;
+    std::vector<char> assigned;
+    std::vector<int> queued, queue;
+};
+
+// Partition the triangles of the current indexed draw into meshlets of at
+// most MESHLET_MAX_TRIANGLES triangles, stored in state.meshlets and
+// state.meshlet_triangles.  Triangles are grouped by growing each meshlet
+// across shared vertices, so that meshlets are spatially compact.  The first
+// three floats of each vertex are taken as its object-space position.
+void build_meshlets(driver_state& state);
+
+// Test the meshlets against the transform in the current uniform data (a mat4
+// in the first 16 floats) and clear state.triangle_visible for the triangles
+// of every meshlet that is entirely outside the view volume, or that faces
+// entirely in the direction selected by state.cull.  Only triangles that
+// would be discarded by clipping or culling anyway are removed.
+void cull_meshlets(driver_state& state);
+
+#endif
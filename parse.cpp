@@ -2,10 +2,51 @@
 #include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <map>
 #include <sstream>
 #include <vector>
 #include "driver_state.h"
 #include "shaders.h"
+#include "shader_vm.h"
+
+// Weld a triangle soup: store each distinct vertex record (compared bit for
+// bit) of data once in welded, and one triangle of indices into welded per
+// group of three vertices.  Identical records give identical vertex shader
+// outputs, so drawing the result as an indexed draw is equivalent.
+static void weld_vertices(const std::vector<float>& data, int floats_per_vertex,
+    std::vector<float>& welded, std::vector<ivec3>& indices)
+{
+    int num_vertices = data.size() / floats_per_vertex;
+    int size = 1;
+    while(size < 2 * num_vertices) size *= 2;
+    std::vector<int> table(size, -1);
+    welded.clear();
+    indices.clear();
+    ivec3 tri;
+    for(int v = 0; v < num_vertices - num_vertices % 3; v++)
+    {
+        const float* record = &data[v * floats_per_vertex];
+        unsigned int hash = 2166136261u;
+        for(int i = 0; i < floats_per_vertex; i++)
+        {
+            unsigned int bits;
+            memcpy(&bits, &record[i], sizeof(bits));
+            hash = (hash ^ bits) * 16777619u;
+        }
+
+        // open addressing with linear probing
+        int slot = hash & (size - 1);
+        while(table[slot] >= 0 && memcmp(&welded[table[slot] * floats_per_vertex], record, floats_per_vertex * sizeof(float)))
+            slot = (slot + 1) & (size - 1);
+        if(table[slot] < 0)
+        {
+            table[slot] = welded.size() / floats_per_vertex;
+            welded.insert(welded.end(), record, record + floats_per_vertex);
+        }
+        tri[v % 3] = table[slot];
+        if(v % 3 == 2) indices.push_back(tri);
+    }
+}
 
 // Parse the input file and issue commands
 void parse(const char* test_file, driver_state& state)
@@ -27,16 +68,23 @@ void parse(const char* test_file, driver_state& state)
 
     // Local copies of the data that will eventually be stored in the driver for
     // rending.  data => driver.vertex_data, indices => driver.index_data,
-    // uniform => driver.uniform_data.  Note that the driver only stores
+    // uniform => driver.uniform_data, instance_uniform =>
+    // driver.instance_uniform_data.  A welded triangle draw uses welded as
+    // the vertex data instead of data.  Note that the driver only stores
     // pointers into these std::vector's.  This is normally a very bad idea,
     // since those pointers may change if the std::vectors are modified.  We
     // must be careful to set the driver pointers only immediately before
     // issuing the rendering commands.  Since the renders occur within this
     // function, this data will not be used after these have gone out of scope.
+    // The same holds for the shaders defined in the file, in fragment_programs.
     int floats_per_vertex=0;
     std::vector<float> data;
     std::vector<ivec3> indices;
     std::vector<float> uniform;
+    std::vector<float> welded;
+    std::vector<float> instance_uniform;
+    int instance_uniform_size=0;
+    std::map<std::string,shader_program> fragment_programs;
 
     // Parse the input, line by line
     while(fgets(buff, sizeof(buff), F))
@@ -97,7 +145,7 @@ void parse(const char* test_file, driver_state& state)
             ss>>e;
             indices.push_back(e);
         }
-        else if(item=="render")
+        else if(item=="render" || item=="render_instanced")
         {
             // format: render <type>
             // Render the information that has been accumulated, and then clear
@@ -108,15 +156,49 @@ void parse(const char* test_file, driver_state& state)
             //            to a triangle.  These numbers are indices into vertex_data.
             // fan -      The vertices are to be interpreted as a triangle fan.
             // strip -    The vertices are to be interpreted as a triangle strip.
+            //
+            // format: render_instanced <type> <count>
+            // Like render, but the geometry is drawn <count> times.  If
+            // instance_uniform lines were given, instance i uses the i-th of
+            // them as its uniform data; otherwise every instance uses the
+            // uniform data.  The instance uniform data is cleared afterward.
+            //
             // Assign pointers in driver immediately before doing the render to
             // avoid memory errors.
             ss>>name;
-            state.vertex_data=&data[0];
-            state.num_vertices=data.size()/floats_per_vertex;
+            int count=1;
+            if(item=="render_instanced")
+            {
+                ss>>count;
+                assert(count>=0);
+                assert(!instance_uniform_size || count*instance_uniform_size<=(int)instance_uniform.size());
+            }
+            std::vector<float>* vertices=&data;
+            if(name=="triangle" && state.weld_vertices && floats_per_vertex)
+            {
+                weld_vertices(data, floats_per_vertex, welded, indices);
+                // Leftover vertices after the last whole triangle are dropped,
+                // not welded; count only the duplicates that were merged.
+                state.stats.vertices_welded+=3*indices.size()-welded.size()/floats_per_vertex;
+                vertices=&welded;
+                name="indexed";
+            }
+            state.vertex_data=vertices->size()?&(*vertices)[0]:0;
+            state.num_vertices=floats_per_vertex?vertices->size()/floats_per_vertex:0;
             state.floats_per_vertex=floats_per_vertex;
             state.index_data=indices.size()?&indices[0][0]:0;
             state.num_triangles=indices.size();
             state.uniform_data=uniform.size()?&uniform[0]:0;
+            state.num_instances=count;
+            state.instance_uniform_data=instance_uniform_size?&instance_uniform[0]:0;
+            state.instance_uniform_size=instance_uniform_size;
+            if(state.fragment_program)
+            {
+                // Instances with their own uniform data read the uniforms
+                // while shading; otherwise they are folded into the shader.
+                if(instance_uniform_size) bind_shader(*state.fragment_program,0,instance_uniform_size,floats_per_vertex);
+                else bind_shader(*state.fragment_program,state.uniform_data,uniform.size(),floats_per_vertex);
+            }
             render_type t;
             if(name=="indexed") t=render_type::indexed;
             else if(name=="fan") t=render_type::fan;
@@ -124,8 +206,13 @@ void parse(const char* test_file, driver_state& state)
             else if(name=="strip") t=render_type::strip;
             else assert("invalid render type" && 0);
             render(state,t);
+            state.num_instances=1;
+            state.instance_uniform_data=0;
+            state.instance_uniform_size=0;
             data.clear();
             indices.clear();
+            instance_uniform.clear();
+            instance_uniform_size=0;
         }
         else if(item=="uniform")
         {
@@ -135,21 +222,89 @@ void parse(const char* test_file, driver_state& state)
             float x;
             while(ss>>x) uniform.push_back(x);
         }
+        else if(item=="instance_uniform")
+        {
+            // format: instance_uniform <float> <float> <float> ...
+            // Provide all of the uniform data for one instance of the next
+            // render_instanced.  Each line adds an instance; all lines must
+            // have the same number of floats.
+            float x;
+            int n=0;
+            while(ss>>x) {instance_uniform.push_back(x);n++;}
+            if(!instance_uniform_size) instance_uniform_size=n;
+            assert(n==instance_uniform_size);
+        }
         else if(item=="vertex_shader")
         {
             // format: vertex_shader <name>
-            // Set the vertex shader
+            // Set the vertex shader, and its batched version if it has one.
             ss>>name;
             state.vertex_shader=vertex_shader_map[name];
             assert(state.vertex_shader);
+            state.vertex_shader_batch=vertex_shader_batch_map.count(name)?vertex_shader_batch_map[name]:0;
+            state.vertex_shader_transform=transform_vertex_shaders.count(name)>0;
         }
         else if(item=="fragment_shader")
         {
             // format: fragment_shader <name>
-            // Set the fragment shader
+            // Set the fragment shader, and its packet version if it has one.
+            // <name> is a built-in shader or one defined with shader.
+            ss>>name;
+            state.fragment_shader=fragment_shader_map.count(name)?fragment_shader_map[name]:0;
+            state.fragment_shader_packet=fragment_shader_packet_map.count(name)?fragment_shader_packet_map[name]:0;
+            state.fragment_program=fragment_programs.count(name)?&fragment_programs[name]:0;
+            assert(state.fragment_shader || state.fragment_program);
+        }
+        else if(item=="shader")
+        {
+            // format: shader <name>
+            //         <statement>
+            //         ...
+            //         end
+            // Define a fragment shader, which fragment_shader can then select
+            // by name.  See shader_vm.h for the statements.  Built-in shaders
+            // cannot be redefined.
             ss>>name;
-            state.fragment_shader=fragment_shader_map[name];
-            assert(state.fragment_shader);
+            if(fragment_shader_map.count(name))
+            {
+                printf("Cannot redefine built-in shader '%s'\n",name.c_str());
+                exit(EXIT_FAILURE);
+            }
+            std::vector<std::string> lines;
+            while(1)
+            {
+                if(!fgets(buff, sizeof(buff), F))
+                {
+                    printf("Missing end of shader '%s'\n",name.c_str());
+                    exit(EXIT_FAILURE);
+                }
+                std::stringstream line(buff);
+                if(line>>item && item=="end") break;
+                lines.push_back(buff);
+            }
+            compile_shader(name.c_str(), lines, fragment_programs[name]);
+        }
+        else if(item=="cull")
+        {
+            // format: cull <mode> [<front>]
+            // Set which triangles are discarded before rasterization, for
+            // this and later renders.  <mode> may be:
+            // none -  Keep all triangles (the default).
+            // back -  Discard triangles facing away from the viewer.
+            // front - Discard triangles facing the viewer.
+            // <front> gives the winding of triangles that face the viewer
+            // on screen, ccw (the default) or cw.
+            ss>>name;
+            if(name=="none") state.cull=cull_mode::none;
+            else if(name=="back") state.cull=cull_mode::back;
+            else if(name=="front") state.cull=cull_mode::front;
+            else assert("invalid cull mode" && 0);
+            state.front_face=winding::ccw;
+            if(ss>>name)
+            {
+                if(name=="cw") state.front_face=winding::cw;
+                else if(name!="ccw") assert("invalid winding" && 0);
+            }
         }
         else
         {
@@ -0,0 +1,204 @@
+#ifndef __RASTER__
+#define __RASTER__
+
+#include "common.h"
+#include <vector>
+
+// This file contains the data structures shared between the triangle setup in
+// driver_state.cpp and the pixel kernels in raster_simd.cpp.
+
+struct driver_state;
+
+// Size (in pixels) of the square blocks used by the hierarchical coverage
+// test.  Blocks are aligned to multiples of this size in screen space.  The
+// pixel kernels process one row of a block at a time, so this is also the
+// SIMD width of the kernels.
+static const int RASTER_BLOCK_SIZE = 8;
+static_assert(RASTER_BLOCK_SIZE == FRAGMENT_PACKET_SIZE, "a block row is shaded as one packet");
+
+// Size (in pixels) of the square screen tiles used for tile-binned rendering.
+// Must be a multiple of RASTER_BLOCK_SIZE, so that every block belongs to
+// exactly one tile.
+static const int RASTER_TILE_SIZE = 64;
+
+// Edge function E(x,y) = a*x + b*y + c, evaluated at integer pixel positions
+// (pixel centers).  E is positive on the inside of the edge.  Stepping one
+// pixel in x or y adds a or b respectively.  Pixels exactly on the edge
+// (E == 0) belong to the triangle only if the edge is a top or left edge;
+// this is encoded in min_inside, which is 0 for top-left edges and 1 otherwise.
+struct edge_function
+{
+    long long a, b, c;
+    long long min_inside;
+};
+
+// Screen-space plane equation of a quantity that varies linearly across a
+// triangle.  Its value at pixel (x,y) is c + dx*(x-origin_x) + dy*(y-origin_y),
+// where (origin_x,origin_y) is the origin of the triangle_setup.
+struct attribute_plane
+{
+    float c, dx, dy;
+};
+
+// Everything about a triangle that is computed once, before any pixels are
+// visited.  The edges are set up for counterclockwise winding.  Rather than
+// barycentric coordinates, every interpolated quantity gets its own plane
+// equation, so that per-fragment interpolation is a single multiply-add.
+struct triangle_setup
+{
+    edge_function edge[3];
+
+    // lane_edge[n][i] = i*edge[n].a; added to the edge value at the start of
+    // a block row to get the edge values of the whole row.
+    long long lane_edge[3][RASTER_BLOCK_SIZE];
+
+    // pixel bounding box, clamped to the image
+    int min_x, min_y, max_x, max_y;
+
+    // pixel relative to which the planes are expressed
+    int origin_x, origin_y;
+
+    // depth (z/w) and 1/w.  inv_w is only set up if num_smooth > 0.
+    attribute_plane depth;
+    attribute_plane inv_w;
+
+    // Planes of the interpolated floats of the vertex data: first
+    // num_noperspective planes for noperspective floats, then num_smooth
+    // planes for smooth floats.  The planes of smooth floats interpolate
+    // data/w, and must be multiplied by the fragment's w.  varying_index
+    // gives the index of the float in the fragment data.
+    int num_noperspective, num_smooth;
+    attribute_plane varying[MAX_FLOATS_PER_VERTEX];
+    int varying_index[MAX_FLOATS_PER_VERTEX];
+
+    // Flat floats take the value of the first vertex everywhere; they are
+    // stored into the fragment data once per triangle, not per fragment.
+    int num_flat;
+    int flat_index[MAX_FLOATS_PER_VERTEX];
+    float flat_value[MAX_FLOATS_PER_VERTEX];
+
+    // Uniform data passed to the fragment shader: that of the draw, or of
+    // the instance of an instanced draw, the triangle belongs to.
+    const float * uniform_data;
+
+    // Index of the triangle in state.deferred->triangles during a deferred
+    // render, which is what the first pass stores in state.image_primitive.
+    int primitive;
+
+    // Color of every fragment, if the fragment shader ignores its input (see
+    // raster_pipeline::constant_color).
+    pixel color;
+};
+
+// Set up the plane of a quantity with values q[n] at the three vertices,
+// given the barycentric coordinates at the origin (bary[0]) and their change
+// per pixel in x (bary[1]) and y (bary[2]).
+inline void setup_plane(attribute_plane& p, const float bary[3][3], const float q[3])
+{
+    p.c = bary[0][0] * q[0] + bary[0][1] * q[1] + bary[0][2] * q[2];
+    p.dx = bary[1][0] * q[0] + bary[1][1] * q[1] + bary[1][2] * q[2];
+    p.dy = bary[2][0] * q[0] + bary[2][1] * q[1] + bary[2][2] * q[2];
+}
+
+// Value of a plane at pixel (x,y).
+inline float plane_at(const attribute_plane& p, const triangle_setup& s, int x, int y)
+{
+    return p.c + p.dx * (x - s.origin_x) + p.dy * (y - s.origin_y);
+}
+
+// One row of a block, handed to a pixel kernel.  The row covers pixels
+// x=bx..bx+RASTER_BLOCK_SIZE-1 on row y, but only pixels in x0..x1 may be
+// written.  e holds the edge function values at (bx,y).  If inside is set,
+// the whole block is known to be inside the triangle.
+struct raster_row
+{
+    int bx, y, x0, x1;
+    long long e[3];
+    bool inside;
+};
+
+// Triangles collected during a tile-binned render.  The triangle setup holds
+// everything needed to rasterize a triangle, so the vertices themselves are
+// not kept.  Each tile lists the triangles that may touch it, in submission
+// order.
+struct raster_bins
+{
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<triangle_setup> triangles;
+    std::vector<std::vector<int> > tiles;
+};
+
+// A deferred render: the set-up triangles, indexed by their primitive, and
+// a flag per block of the hierarchical z-buffer for the blocks the first pass
+// wrote to, which the second pass visits.
+struct raster_deferred
+{
+    std::vector<triangle_setup> triangles;
+    std::vector<char> blocks;
+};
+
+// A pixel kernel performs the inside test, depth test, interpolation and
+// shading for one row of a block.  The row is shaded as one packet: frag.data
+// must have room for MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE floats, and
+// the flat floats of the triangle must already be stored in it, for every
+// fragment of the packet.  Returns a mask of the pixels that were written
+// (bit i for pixel bx+i).
+typedef int (*raster_row_kernel)(driver_state& state, const triangle_setup& s,
+    const raster_row& row, data_fragment_packet& frag);
+
+// The second pass of a deferred render, for one row of a block: the pixels
+// x=bx..bx+RASTER_BLOCK_SIZE-1 (within the image) on row y whose entry in
+// state.image_primitive is set are interpolated and shaded with the triangle
+// stored there, and the entries are cleared.  frag.data must have room for
+// MAX_FLOATS_PER_VERTEX * FRAGMENT_PACKET_SIZE floats.  Returns the number of
+// pixels shaded.
+typedef int (*raster_resolve_row)(driver_state& state, int bx, int y, data_fragment_packet& frag);
+
+// Compute the color a fragment shader that ignores its input gives every
+// fragment, for the given uniform data.
+typedef pixel (*raster_constant_color)(const float * uniform_data);
+
+// Sets up the planes and flat values of the varyings of a triangle (see
+// triangle_setup), given the barycentric coordinates at the origin (bary[0])
+// and their change per pixel in x (bary[1]) and y (bary[2]), and 1/w at each
+// vertex.
+typedef void (*raster_setup_varyings)(const driver_state& state, const data_geometry* tri[3],
+    const float bary[3][3], const float inv_w[3], triangle_setup& s);
+
+// The varying setup and pixel kernels used for a draw.  Common vertex_data
+// layouts get versions specialized at compile time, where the number and
+// interpolation of the floats are constants.  Other layouts use a generic
+// pipeline (with a null signature), which reads them from the draw state.
+// Likewise, the kernels of the built-in fragment shaders are specialized for
+// the shader (fragment_shader), and other shaders use kernels that call
+// state.fragment_shader (with a null fragment_shader).
+struct raster_pipeline
+{
+    const char* signature;
+    shader_f fragment_shader;
+    raster_setup_varyings setup_varyings;
+
+    // The fastest kernel supported by the CPU we are running on.  Rows that
+    // extend past the right edge of the image must use scalar_kernel, since
+    // the vector kernels load and store whole rows.
+    raster_row_kernel vector_kernel;
+    raster_row_kernel scalar_kernel;
+
+    // Kernels for the first pass of a deferred render, which only test and
+    // write depth and store the primitive of the pixels written, and the
+    // second pass.
+    raster_row_kernel vector_visibility_kernel;
+    raster_row_kernel scalar_visibility_kernel;
+    raster_resolve_row resolve_row;
+
+    // Set if the fragment shader ignores its input.  The color is then
+    // computed once per draw (or instance), and the kernels store it without
+    // interpolating the floats or calling the shader.
+    raster_constant_color constant_color;
+};
+
+// Return the pipeline for the vertex_data layout of the current draw
+// (state.floats_per_vertex and state.interp_rules) and its fragment shader.
+const raster_pipeline& select_raster_pipeline(const driver_state& state);
+
+#endif
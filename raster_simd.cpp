@@ -0,0 +1,573 @@
+#include "raster.h"
+#include "driver_state.h"
+#include "shaders.h"
+#include "shader_vm.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// The vector kernels are compiled for SSE4.2 and AVX2 using function target
+// attributes, so the rest of the program does not need to be built with those
+// instruction sets enabled.  select_raster_pipeline picks one at run time.
+//
+// The kernels take the number of noperspective and smooth planes as template
+// parameters; -1 means the counts are read from the triangle setup at run
+// time.  With the counts known at compile time the per-varying loops are
+// fully unrolled.  They also take the fragment shader as a type (see
+// builtin_fragment_shaders), whose body the compiler can inline, or
+// fragment_pointer to call state.fragment_shader.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Bit i is set if pixel bx+i of the row lies in x0..x1.
+static inline int row_lane_mask(const raster_row& row)
+{
+    return ((1 << (row.x1 - row.bx + 1)) - 1) & ~((1 << (row.x0 - row.bx)) - 1);
+}
+
+// Number of planes of a kind: the template parameter if known at compile time,
+// otherwise the run-time count.
+#define PLANE_COUNT(N, runtime) ((N) < 0 ? (runtime) : (N))
+
+// Shader type of kernels for fragment shaders that are only known through
+// the function pointer in the draw state.
+struct fragment_pointer {};
+
+// Shader type of the kernels of the first pass of a deferred render, which
+// store the primitive of each pixel written rather than shading it.
+struct fragment_visibility {};
+
+// Run the fragment shader FS on a packet of fragments.  varyings is false if
+// the kernels need not interpolate the varyings for FS, and invariant is true
+// if they store triangle_setup::color instead of calling FS.
+template<class FS>
+struct fragment_call
+{
+    static const bool invariant = FS::invariant;
+    static const bool varyings = !FS::invariant;
+
+    static void shade_packet(const driver_state& state, const data_fragment_packet& in,
+        data_output_packet& out, const float * uniform_data)
+    {FS::shade_packet(in, out, uniform_data);}
+};
+
+// Shaders known through their pointers use their packet version if they have
+// one, and are otherwise called once per covered fragment.  Shaders defined
+// in the scene file are interpreted a packet at a time.
+template<>
+struct fragment_call<fragment_pointer>
+{
+    static const bool invariant = false;
+    static const bool varyings = true;
+
+    static void shade_packet(const driver_state& state, const data_fragment_packet& in,
+        data_output_packet& out, const float * uniform_data)
+    {
+        if(state.fragment_program) {
+            run_shader(*state.fragment_program, in, out, uniform_data);
+            return;
+        }
+        if(state.fragment_shader_packet) {
+            state.fragment_shader_packet(in, out, uniform_data);
+            return;
+        }
+        float data[MAX_FLOATS_PER_VERTEX];
+        data_fragment frag{data};
+        data_output color;
+        for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+            if(!(in.mask >> k & 1)) { continue; }
+            for(int i = 0; i < state.floats_per_vertex; i++) {
+                data[i] = in.data[i * FRAGMENT_PACKET_SIZE + k];
+            }
+            state.fragment_shader(frag, color, uniform_data);
+            for(int c = 0; c < 4; c++) {
+                out.output_color[c][k] = color.output_color[c];
+            }
+        }
+    }
+};
+
+// Shade the pixels of the row set in passed as one packet, whose floats have
+// been stored in frag, and store the resulting colors.  Depth has already
+// been written by the caller.
+template<class FS>
+static void shade_row(driver_state& state, const triangle_setup& s, data_fragment_packet& frag,
+    int passed, const raster_row& row)
+{
+    int index = row.bx + row.y * state.image_width;
+    if(fragment_call<FS>::invariant) {
+        for(int i = 0; i < RASTER_BLOCK_SIZE; i++) {
+            if(passed >> i & 1) { state.image_color[index + i] = s.color; }
+        }
+        return;
+    }
+
+    data_output_packet out;
+    frag.mask = passed;
+    fragment_call<FS>::shade_packet(state, frag, out, s.uniform_data);
+    for(int i = 0; i < RASTER_BLOCK_SIZE; i++) {
+        if(!(passed >> i & 1)) { continue; }
+        state.image_color[index + i] = make_pixel(out.output_color[0][i] * 255, out.output_color[1][i] * 255, out.output_color[2][i] * 255);
+    }
+}
+
+template<>
+struct fragment_call<fragment_visibility>
+{
+    static const bool invariant = false;
+    static const bool varyings = false;
+};
+
+template<>
+void shade_row<fragment_visibility>(driver_state& state, const triangle_setup& s, data_fragment_packet& frag,
+    int passed, const raster_row& row)
+{
+    int* primitive = state.image_primitive + row.bx + row.y * state.image_width;
+    for(int i = 0; i < RASTER_BLOCK_SIZE; i++) {
+        if(passed >> i & 1) { primitive[i] = s.primitive; }
+    }
+}
+
+// Portable kernel; processes one pixel at a time, and shades the row as a
+// packet at the end.
+template<int NP, int NS, class FS>
+static int raster_row_scalar(driver_state& state, const triangle_setup& s,
+    const raster_row& row, data_fragment_packet& frag)
+{
+    const int num_noperspective = PLANE_COUNT(NP, s.num_noperspective);
+    const int num_smooth = PLANE_COUNT(NS, s.num_smooth);
+    const int num_planes = num_noperspective + num_smooth;
+    float depth_row = plane_at(s.depth, s, row.bx, row.y);
+    float inv_w_row = 0;
+    float varying_row[MAX_FLOATS_PER_VERTEX];
+    bool have_rows = false;
+
+    int passed = 0;
+    for(int x = row.x0; x <= row.x1; x++) {
+        int i = x - row.bx;
+        if(!row.inside
+            && (row.e[0] + s.lane_edge[0][i] < s.edge[0].min_inside
+            || row.e[1] + s.lane_edge[1][i] < s.edge[1].min_inside
+            || row.e[2] + s.lane_edge[2][i] < s.edge[2].min_inside)) {
+            continue;
+        }
+
+        float depth = depth_row + i * s.depth.dx;
+        int index = x + row.y * state.image_width;
+        if(!(state.image_depth[index] > depth)) { continue; }
+
+        state.image_depth[index] = depth;
+        passed |= 1 << i;
+        if(!fragment_call<FS>::varyings) { continue; }
+
+        // plane values at the start of the row, once a fragment needs them
+        if(!have_rows) {
+            if(num_smooth) { inv_w_row = plane_at(s.inv_w, s, row.bx, row.y); }
+            for(int p = 0; p < num_planes; p++) {
+                varying_row[p] = plane_at(s.varying[p], s, row.bx, row.y);
+            }
+            have_rows = true;
+        }
+
+        float w = 0;
+        if(num_smooth) { w = 1 / (inv_w_row + i * s.inv_w.dx); }
+        for(int p = 0; p < num_noperspective; p++) {
+            frag.data[s.varying_index[p] * FRAGMENT_PACKET_SIZE + i] = varying_row[p] + i * s.varying[p].dx;
+        }
+        for(int p = num_noperspective; p < num_planes; p++) {
+            frag.data[s.varying_index[p] * FRAGMENT_PACKET_SIZE + i] = (varying_row[p] + i * s.varying[p].dx) * w;
+        }
+    }
+    if(passed) { shade_row<FS>(state, s, frag, passed, row); }
+    return passed;
+}
+
+#ifdef RASTER_X86_SIMD
+
+// AVX2 kernel: the whole row is one register.  The inside test uses 64-bit
+// integer lanes (two registers per edge), the depth test and interpolation
+// use eight float lanes.
+template<int NP, int NS, class FS>
+__attribute__((target("avx2")))
+static int raster_row_avx2(driver_state& state, const triangle_setup& s,
+    const raster_row& row, data_fragment_packet& frag)
+{
+    const int num_noperspective = PLANE_COUNT(NP, s.num_noperspective);
+    const int num_smooth = PLANE_COUNT(NS, s.num_smooth);
+    const int num_planes = num_noperspective + num_smooth;
+    int covered = row_lane_mask(row);
+    if(!row.inside) {
+        for(int n = 0; n < 3; n++) {
+            __m256i e = _mm256_set1_epi64x(row.e[n]);
+            __m256i t = _mm256_set1_epi64x(s.edge[n].min_inside - 1);
+            __m256i lo = _mm256_add_epi64(e, _mm256_loadu_si256((const __m256i*)&s.lane_edge[n][0]));
+            __m256i hi = _mm256_add_epi64(e, _mm256_loadu_si256((const __m256i*)&s.lane_edge[n][4]));
+            covered &= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(lo, t)))
+                | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(hi, t))) << 4;
+        }
+        if(!covered) { return 0; }
+    }
+
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 depth = _mm256_add_ps(_mm256_set1_ps(plane_at(s.depth, s, row.bx, row.y)),
+        _mm256_mul_ps(lanes, _mm256_set1_ps(s.depth.dx)));
+
+    // masked depth test against the stored depth
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(covered), bits), bits);
+    float* zbuf = state.image_depth + row.bx + row.y * state.image_width;
+    __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(_mm256_loadu_ps(zbuf), depth, _CMP_GT_OQ));
+    int passed = _mm256_movemask_ps(pass);
+    if(!passed) { return 0; }
+    _mm256_maskstore_ps(zbuf, _mm256_castps_si256(pass), depth);
+    if(fragment_call<FS>::invariant) {
+        int* cbuf = (int*)(state.image_color + row.bx + row.y * state.image_width);
+        _mm256_maskstore_epi32(cbuf, _mm256_castps_si256(pass), _mm256_set1_epi32(s.color));
+        return passed;
+    }
+
+    __m256 w = _mm256_setzero_ps();
+    if(num_smooth && fragment_call<FS>::varyings) {
+        __m256 inv_w = _mm256_add_ps(_mm256_set1_ps(plane_at(s.inv_w, s, row.bx, row.y)),
+            _mm256_mul_ps(lanes, _mm256_set1_ps(s.inv_w.dx)));
+        w = _mm256_div_ps(_mm256_set1_ps(1), inv_w);
+    }
+    for(int p = 0; p < num_planes && fragment_call<FS>::varyings; p++) {
+        __m256 v = _mm256_add_ps(_mm256_set1_ps(plane_at(s.varying[p], s, row.bx, row.y)),
+            _mm256_mul_ps(lanes, _mm256_set1_ps(s.varying[p].dx)));
+        if(p >= num_noperspective) { v = _mm256_mul_ps(v, w); }
+        _mm256_storeu_ps(frag.data + s.varying_index[p] * FRAGMENT_PACKET_SIZE, v);
+    }
+    shade_row<FS>(state, s, frag, passed, row);
+    return passed;
+}
+
+// SSE4.2 kernel: the row is processed as two halves of four pixels.
+template<int NP, int NS, class FS>
+__attribute__((target("sse4.2")))
+static int raster_row_sse4(driver_state& state, const triangle_setup& s,
+    const raster_row& row, data_fragment_packet& frag)
+{
+    const int num_noperspective = PLANE_COUNT(NP, s.num_noperspective);
+    const int num_smooth = PLANE_COUNT(NS, s.num_smooth);
+    const int num_planes = num_noperspective + num_smooth;
+    int covered = row_lane_mask(row);
+    if(!row.inside) {
+        for(int n = 0; n < 3; n++) {
+            __m128i e = _mm_set1_epi64x(row.e[n]);
+            __m128i t = _mm_set1_epi64x(s.edge[n].min_inside - 1);
+            int m = 0;
+            for(int i = 0; i < RASTER_BLOCK_SIZE; i += 2) {
+                __m128i v = _mm_add_epi64(e, _mm_loadu_si128((const __m128i*)&s.lane_edge[n][i]));
+                m |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, t))) << i;
+            }
+            covered &= m;
+        }
+        if(!covered) { return 0; }
+    }
+
+    float* zbuf = state.image_depth + row.bx + row.y * state.image_width;
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    float depth_row = plane_at(s.depth, s, row.bx, row.y);
+    int passed = 0;
+    for(int h = 0; h < RASTER_BLOCK_SIZE; h += 4) {
+        const __m128 lanes = _mm_setr_ps(h, h + 1, h + 2, h + 3);
+        __m128 depth = _mm_add_ps(_mm_set1_ps(depth_row), _mm_mul_ps(lanes, _mm_set1_ps(s.depth.dx)));
+
+        __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(covered >> h), bits), bits);
+        __m128 old = _mm_loadu_ps(zbuf + h);
+        __m128 pass = _mm_and_ps(_mm_castsi128_ps(mask), _mm_cmpgt_ps(old, depth));
+        int half = _mm_movemask_ps(pass);
+        if(!half) { continue; }
+        _mm_storeu_ps(zbuf + h, _mm_blendv_ps(old, depth, pass));
+        passed |= half << h;
+        if(fragment_call<FS>::invariant) {
+            __m128i* cbuf = (__m128i*)(state.image_color + row.bx + row.y * state.image_width + h);
+            _mm_storeu_si128(cbuf, _mm_blendv_epi8(_mm_loadu_si128(cbuf), _mm_set1_epi32(s.color), _mm_castps_si128(pass)));
+            continue;
+        }
+
+        __m128 w = _mm_setzero_ps();
+        if(num_smooth && fragment_call<FS>::varyings) {
+            __m128 inv_w = _mm_add_ps(_mm_set1_ps(plane_at(s.inv_w, s, row.bx, row.y)),
+                _mm_mul_ps(lanes, _mm_set1_ps(s.inv_w.dx)));
+            w = _mm_div_ps(_mm_set1_ps(1), inv_w);
+        }
+        for(int p = 0; p < num_planes && fragment_call<FS>::varyings; p++) {
+            __m128 v = _mm_add_ps(_mm_set1_ps(plane_at(s.varying[p], s, row.bx, row.y)),
+                _mm_mul_ps(lanes, _mm_set1_ps(s.varying[p].dx)));
+            if(p >= num_noperspective) { v = _mm_mul_ps(v, w); }
+            _mm_storeu_ps(frag.data + s.varying_index[p] * FRAGMENT_PACKET_SIZE + h, v);
+        }
+    }
+    if(passed && !fragment_call<FS>::invariant) { shade_row<FS>(state, s, frag, passed, row); }
+    return passed;
+}
+
+#endif
+
+// The second pass of a deferred render (see raster_resolve_row).  Pixels of
+// the row with the same primitive are shaded as one packet.  The planes are
+// evaluated exactly as the pixel kernels evaluate them, so the result is
+// identical to shading the pixels in the first pass.
+template<int NP, int NS, class FS>
+static int resolve_row(driver_state& state, int bx, int y, data_fragment_packet& frag)
+{
+    int* primitive = state.image_primitive + bx + y * state.image_width;
+    int lanes = std::min(RASTER_BLOCK_SIZE, state.image_width - bx);
+    int pending = 0;
+    for(int i = 0; i < lanes; i++) {
+        if(primitive[i] >= 0) { pending |= 1 << i; }
+    }
+
+    int shaded = 0;
+    while(pending) {
+        // the pending pixels with the same primitive as the first one
+        int id = primitive[__builtin_ctz(pending)];
+        const triangle_setup& s = state.deferred->triangles[id];
+        int mask = 0;
+        for(int i = 0; i < lanes; i++) {
+            if((pending >> i & 1) && primitive[i] == id) {
+                mask |= 1 << i;
+                primitive[i] = -1;
+            }
+        }
+        pending &= ~mask;
+        shaded += __builtin_popcount(mask);
+
+        const int num_noperspective = PLANE_COUNT(NP, s.num_noperspective);
+        const int num_smooth = PLANE_COUNT(NS, s.num_smooth);
+        const int num_planes = num_noperspective + num_smooth;
+        for(int f = 0; f < s.num_flat; f++) {
+            for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+                frag.data[s.flat_index[f] * FRAGMENT_PACKET_SIZE + k] = s.flat_value[f];
+            }
+        }
+        if(fragment_call<FS>::varyings) {
+            float inv_w_row = 0;
+            float varying_row[MAX_FLOATS_PER_VERTEX];
+            if(num_smooth) { inv_w_row = plane_at(s.inv_w, s, bx, y); }
+            for(int p = 0; p < num_planes; p++) {
+                varying_row[p] = plane_at(s.varying[p], s, bx, y);
+            }
+            for(int i = 0; i < lanes; i++) {
+                if(!(mask >> i & 1)) { continue; }
+                float w = 0;
+                if(num_smooth) { w = 1 / (inv_w_row + i * s.inv_w.dx); }
+                for(int p = 0; p < num_noperspective; p++) {
+                    frag.data[s.varying_index[p] * FRAGMENT_PACKET_SIZE + i] = varying_row[p] + i * s.varying[p].dx;
+                }
+                for(int p = num_noperspective; p < num_planes; p++) {
+                    frag.data[s.varying_index[p] * FRAGMENT_PACKET_SIZE + i] = (varying_row[p] + i * s.varying[p].dx) * w;
+                }
+            }
+        }
+
+        raster_row row;
+        row.bx = bx;
+        row.y = y;
+        shade_row<FS>(state, s, frag, mask, row);
+    }
+    return shaded;
+}
+
+// Set up the planes of the varyings for an arbitrary vertex_data layout.
+// Planes are ordered as described in triangle_setup: noperspective floats
+// first, then smooth floats, each in order of their index.
+static void setup_varyings_generic(const driver_state& state, const data_geometry* tri[3],
+    const float bary[3][3], const float inv_w[3], triangle_setup& s)
+{
+    s.num_noperspective = s.num_smooth = s.num_flat = 0;
+    for(int z = 0; z < state.floats_per_vertex; z++) {
+        if(state.interp_rules[z] == interp_type::noperspective) {
+            float q[3] = { tri[0]->data[z], tri[1]->data[z], tri[2]->data[z] };
+            setup_plane(s.varying[s.num_noperspective], bary, q);
+            s.varying_index[s.num_noperspective++] = z;
+        }
+        else if(state.interp_rules[z] == interp_type::flat) {
+            s.flat_index[s.num_flat] = z;
+            s.flat_value[s.num_flat++] = tri[0]->data[z];
+        }
+    }
+    for(int z = 0; z < state.floats_per_vertex; z++) {
+        if(state.interp_rules[z] == interp_type::smooth) {
+            float q[3] = { tri[0]->data[z] * inv_w[0], tri[1]->data[z] * inv_w[1], tri[2]->data[z] * inv_w[2] };
+            int p = s.num_noperspective + s.num_smooth++;
+            setup_plane(s.varying[p], bary, q);
+            s.varying_index[p] = z;
+        }
+    }
+}
+
+// Number of times r occurs in the rest of the arguments.
+constexpr int count_rule(char r)
+{return 0;}
+
+template<class... R>
+constexpr int count_rule(char r, char first, R... rest)
+{return (first == r) + count_rule(r, rest...);}
+
+// Compile-time description of a vertex_data layout; for example "fffsss" is
+// interp_signature<'f','f','f','s','s','s'>.
+template<char... rules>
+struct interp_signature
+{
+    static constexpr int size = sizeof...(rules);
+    static constexpr int num_noperspective = count_rule('n', rules...);
+    static constexpr int num_smooth = count_rule('s', rules...);
+    static constexpr char rule[size] = {rules...};
+};
+
+template<char... rules>
+constexpr char interp_signature<rules...>::rule[];
+
+// Same as setup_varyings_generic, for a layout known at compile time.
+template<class sig>
+static void setup_varyings(const driver_state& state, const data_geometry* tri[3],
+    const float bary[3][3], const float inv_w[3], triangle_setup& s)
+{
+    int np = 0, ns = sig::num_noperspective;
+    s.num_noperspective = sig::num_noperspective;
+    s.num_smooth = sig::num_smooth;
+    s.num_flat = 0;
+    for(int z = 0; z < sig::size; z++) {
+        if(sig::rule[z] == 'n') {
+            float q[3] = { tri[0]->data[z], tri[1]->data[z], tri[2]->data[z] };
+            setup_plane(s.varying[np], bary, q);
+            s.varying_index[np++] = z;
+        }
+        else if(sig::rule[z] == 's') {
+            float q[3] = { tri[0]->data[z] * inv_w[0], tri[1]->data[z] * inv_w[1], tri[2]->data[z] * inv_w[2] };
+            setup_plane(s.varying[ns], bary, q);
+            s.varying_index[ns++] = z;
+        }
+        else {
+            s.flat_index[s.num_flat] = z;
+            s.flat_value[s.num_flat++] = tri[0]->data[z];
+        }
+    }
+}
+
+// The color FS gives every fragment, if it ignores its input, computed as
+// shade_row would.
+template<class FS>
+static pixel constant_color(const float * uniform_data)
+{
+    data_fragment_packet in{0, 0};
+    data_output_packet out;
+    FS::shade_packet(in, out, uniform_data);
+    return make_pixel(out.output_color[0][0] * 255, out.output_color[1][0] * 255, out.output_color[2][0] * 255);
+}
+
+template<class FS>
+static raster_constant_color constant_color_function(FS*)
+{
+    return FS::invariant ? constant_color<FS> : 0;
+}
+
+static raster_constant_color constant_color_function(fragment_pointer*)
+{
+    return 0;
+}
+
+// Instruction sets the vector kernels can use.
+enum class raster_isa {scalar, sse4, avx2};
+
+// Build a pipeline from the setup and kernels specialized for NP
+// noperspective and NS smooth planes and the fragment shader FS.
+template<int NP, int NS, class FS>
+static raster_pipeline make_pipeline(const char* signature, shader_f fragment_shader,
+    raster_setup_varyings setup, raster_isa isa)
+{
+    raster_pipeline p;
+    p.signature = signature;
+    p.fragment_shader = fragment_shader;
+    p.setup_varyings = setup;
+    p.scalar_kernel = raster_row_scalar<NP, NS, FS>;
+    p.vector_kernel = raster_row_scalar<NP, NS, FS>;
+    p.scalar_visibility_kernel = raster_row_scalar<0, 0, fragment_visibility>;
+    p.vector_visibility_kernel = raster_row_scalar<0, 0, fragment_visibility>;
+    p.resolve_row = resolve_row<NP, NS, FS>;
+    p.constant_color = constant_color_function((FS*)0);
+#ifdef RASTER_X86_SIMD
+    if(isa == raster_isa::avx2) {
+        p.vector_kernel = raster_row_avx2<NP, NS, FS>;
+        p.vector_visibility_kernel = raster_row_avx2<0, 0, fragment_visibility>;
+    }
+    if(isa == raster_isa::sse4) {
+        p.vector_kernel = raster_row_sse4<NP, NS, FS>;
+        p.vector_visibility_kernel = raster_row_sse4<0, 0, fragment_visibility>;
+    }
+#endif
+    return p;
+}
+
+// Add the pipelines of one vertex_data layout to table: one for each of the
+// shaders, then one that calls the fragment shader through its pointer.
+template<int NP, int NS, class... shaders>
+static void add_pipelines(std::vector<raster_pipeline>& table, const char* signature,
+    raster_setup_varyings setup, raster_isa isa, shader_list<shaders...>)
+{
+    raster_pipeline p[] = {
+        make_pipeline<NP, NS, shaders>(signature, shaders::shade, setup, isa)...,
+        make_pipeline<NP, NS, fragment_pointer>(signature, 0, setup, isa)
+    };
+    table.insert(table.end(), p, p + sizeof(p) / sizeof(p[0]));
+}
+
+template<class sig>
+static void add_pipelines(std::vector<raster_pipeline>& table, const char* signature, raster_isa isa)
+{
+    add_pipelines<sig::num_noperspective, sig::num_smooth>(table, signature, setup_varyings<sig>,
+        isa, builtin_fragment_shaders());
+}
+
+const raster_pipeline& select_raster_pipeline(const driver_state& state)
+{
+    // The pipelines of the layouts that are specialized at compile time,
+    // then those of the generic layout (with a null signature), each
+    // instantiated for every built-in fragment shader.  The table is built
+    // on the first call, once the CPU features are known.
+    struct pipeline_table
+    {
+        std::vector<raster_pipeline> entries;
+
+        pipeline_table()
+        {
+            raster_isa isa = raster_isa::scalar;
+#ifdef RASTER_X86_SIMD
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2")) { isa = raster_isa::avx2; }
+            else if(__builtin_cpu_supports("sse4.2")) { isa = raster_isa::sse4; }
+#endif
+            add_pipelines<interp_signature<'f','f','f'> >(entries, "fff", isa);
+            add_pipelines<interp_signature<'f','f','f','f','f','f'> >(entries, "ffffff", isa);
+            add_pipelines<interp_signature<'f','f','f','s','s','s'> >(entries, "fffsss", isa);
+            add_pipelines<interp_signature<'f','f','f','n','n','n'> >(entries, "fffnnn", isa);
+            add_pipelines<-1, -1>(entries, 0, setup_varyings_generic, isa, builtin_fragment_shaders());
+        }
+    };
+    static const pipeline_table table;
+
+    // signature of the current layout, in the vertex_data format
+    char signature[MAX_FLOATS_PER_VERTEX + 1];
+    for(int z = 0; z < state.floats_per_vertex; z++) {
+        switch(state.interp_rules[z]) {
+            case interp_type::smooth: signature[z] = 's'; break;
+            case interp_type::noperspective: signature[z] = 'n'; break;
+            default: signature[z] = 'f'; break;
+        }
+    }
+    signature[state.floats_per_vertex] = 0;
+
+    // The first pipeline for the layout whose shader is the draw's, or
+    // failing that the one that calls it through its pointer.
+    for(size_t i = 0; i < table.entries.size(); i++) {
+        const raster_pipeline& p = table.entries[i];
+        if(p.signature && strcmp(p.signature, signature)) { continue; }
+        if(!p.fragment_shader || p.fragment_shader == state.fragment_shader) { return p; }
+    }
+    return table.entries.back();
+}
@@ -0,0 +1,326 @@
+/**
+ * reorder.cpp
+ * -------------------------------
+ * Reorders the indexed draws of a scene file for vertex cache locality.
+ *
+ * Usage: ./reorder -i <input-file> -o <output-file> [ -c <cache-size> ]
+ *     <input-file>      Scene file to read
+ *     <output-file>     Reordered scene file to write
+ *     <cache-size>      Entries in the modeled vertex cache (default 32)
+ *
+ * For every "render indexed" or "render_instanced indexed <count>" command,
+ * the triangles (f lines) of the draw are reordered with the Tipsify
+ * algorithm (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex
+ * Locality and Reduced Overdraw", 2007), so that triangles sharing vertices
+ * are drawn close together.  The vertices
+ * (v lines) are then renumbered in the order the reordered triangles first use
+ * them, so that they are also fetched roughly in memory order.  All other
+ * lines (including shader definitions), and draws of other types, are copied
+ * unchanged.  The resulting scene
+ * draws the same triangles, only in a different order.
+ *
+ * For each reordered draw, the average cache miss ratio (ACMR, vertex cache
+ * misses per triangle) is reported before and after, for a FIFO vertex cache
+ * with <cache-size> entries.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// A triangle of an indexed draw.
+struct triangle
+{
+    int v[3];
+};
+
+// Average number of misses per triangle of a FIFO vertex cache with
+// cache_size entries, for the triangles drawn in order.
+double acmr(const std::vector<triangle>& tris, int num_vertices, int cache_size)
+{
+    if(tris.empty()) return 0;
+
+    // A vertex is cached if it entered the cache less than cache_size
+    // misses ago.
+    std::vector<long> entered(num_vertices, -cache_size - 1);
+    long misses = 0;
+    for(size_t t = 0; t < tris.size(); t++) {
+        for(int j = 0; j < 3; j++) {
+            int v = tris[t].v[j];
+            if(misses - entered[v] > cache_size) {
+                entered[v] = misses;
+                misses++;
+            }
+        }
+    }
+    return (double)misses / tris.size();
+}
+
+// Tipsify: returns the triangles of tris in a cache-friendly order, for a
+// cache with cache_size entries.  The mesh is walked by fanning around one
+// vertex at a time, emitting all of its remaining triangles.  The next vertex
+// to fan around is the one among those just emitted that is most likely to
+// still be cached when its remaining triangles are emitted; if there is none,
+// a recently used vertex with triangles left is taken from a dead-end stack,
+// or failing that the next such vertex in input order.
+std::vector<triangle> tipsify(const std::vector<triangle>& tris, int num_vertices, int cache_size)
+{
+    if(tris.empty()) return tris;
+
+    // triangles using each vertex, as offsets into adjacency
+    std::vector<int> offset(num_vertices + 1, 0);
+    for(size_t t = 0; t < tris.size(); t++) {
+        for(int j = 0; j < 3; j++) offset[tris[t].v[j] + 1]++;
+    }
+    for(int v = 0; v < num_vertices; v++) offset[v + 1] += offset[v];
+    std::vector<int> adjacency(offset[num_vertices]);
+    std::vector<int> fill(offset);
+    for(size_t t = 0; t < tris.size(); t++) {
+        for(int j = 0; j < 3; j++) adjacency[fill[tris[t].v[j]]++] = t;
+    }
+
+    // live[v]: triangles using v not yet emitted.  cached[v]: time stamp at
+    // which v entered the cache, where the time advances by one per miss.
+    std::vector<int> live(num_vertices);
+    for(int v = 0; v < num_vertices; v++) live[v] = offset[v + 1] - offset[v];
+    std::vector<int> cached(num_vertices, 0);
+    std::vector<char> emitted(tris.size(), 0);
+    std::vector<int> dead_end;
+    std::vector<int> candidates;
+    std::vector<triangle> out;
+    out.reserve(tris.size());
+
+    int time = cache_size + 1;
+    int cursor = 0;
+    int fan = 0;
+    while(fan >= 0) {
+        candidates.clear();
+        for(int a = offset[fan]; a < offset[fan + 1]; a++) {
+            int t = adjacency[a];
+            if(emitted[t]) continue;
+            emitted[t] = 1;
+            out.push_back(tris[t]);
+            for(int j = 0; j < 3; j++) {
+                int v = tris[t].v[j];
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if(time - cached[v] > cache_size) {
+                    cached[v] = time;
+                    time++;
+                }
+            }
+        }
+
+        // Pick the candidate that will still be in the cache after its
+        // remaining triangles are emitted (each adds at most two misses),
+        // preferring the one that entered the cache earliest.
+        fan = -1;
+        int best = -1;
+        for(size_t c = 0; c < candidates.size(); c++) {
+            int v = candidates[c];
+            if(live[v] <= 0) continue;
+            int priority = 0;
+            if(time - cached[v] + 2 * live[v] <= cache_size) priority = time - cached[v];
+            if(priority > best) {
+                best = priority;
+                fan = v;
+            }
+        }
+
+        // Dead end: no emitted vertex has triangles left.
+        while(fan < 0 && !dead_end.empty()) {
+            int v = dead_end.back();
+            dead_end.pop_back();
+            if(live[v] > 0) fan = v;
+        }
+        while(fan < 0 && cursor < num_vertices) {
+            if(live[cursor] > 0) fan = cursor;
+            cursor++;
+        }
+    }
+    return out;
+}
+
+// Provide assistance in calling this program
+void Usage(const char* prog_name)
+{
+    fprintf(stderr, "Usage: %s -i <input-file> -o <output-file> [ -c <cache-size> ]\n", prog_name);
+    fprintf(stderr, "    <input-file>      Scene file to read\n");
+    fprintf(stderr, "    <output-file>     Reordered scene file to write\n");
+    fprintf(stderr, "    <cache-size>      Entries in the modeled vertex cache (default 32)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    const char* input_file = 0;
+    const char* output_file = 0;
+    int cache_size = 32;
+
+    // Parse commandline options
+    while(1)
+    {
+        int opt = getopt(argc, argv, "i:o:c:");
+        if(opt==-1) break;
+        switch(opt)
+        {
+            case 'i': input_file = optarg; break;
+            case 'o': output_file = optarg; break;
+            case 'c': cache_size = atoi(optarg); break;
+        }
+    }
+    if(!input_file || !output_file || cache_size < 3) Usage(argv[0]);
+
+    FILE* in = fopen(input_file, "r");
+    if(!in)
+    {
+        printf("Failed to open file '%s'\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // The lines of the current draw.  The v and f lines are held back;
+    // other lines are kept in order, and the v and f lines are written where
+    // the first of each appeared (marked by first_v and first_f).
+    std::vector<std::string> lines;
+    std::vector<std::string> vertices;
+    std::vector<triangle> tris;
+    int first_v = -1, first_f = -1;
+    std::string output;
+    int draw = 0;
+
+    char buff[1000];
+    int line_number = 0;
+    while(fgets(buff, sizeof(buff), in))
+    {
+        line_number++;
+        std::string line = buff;
+        if(line.empty() || line[line.size() - 1] != '\n') line += '\n';
+        std::stringstream ss(line);
+        std::string item, name;
+        if(!(ss>>item)) item = "";
+
+        // Shader definitions are copied as a whole; their statements may
+        // assign to variables called v or f.
+        if(item=="shader")
+        {
+            lines.push_back(line);
+            while(fgets(buff, sizeof(buff), in))
+            {
+                line_number++;
+                line = buff;
+                if(line.empty() || line[line.size() - 1] != '\n') line += '\n';
+                lines.push_back(line);
+                std::stringstream statement(line);
+                if(statement>>item && item=="end") break;
+            }
+            continue;
+        }
+        if(item=="v")
+        {
+            if(first_v < 0) { first_v = lines.size(); lines.push_back(""); }
+            vertices.push_back(line);
+            continue;
+        }
+        if(item=="f")
+        {
+            if(first_f < 0) { first_f = lines.size(); lines.push_back(""); }
+            triangle t;
+            if(!(ss>>t.v[0]>>t.v[1]>>t.v[2]))
+            {
+                printf("Invalid triangle on line %d: %s", line_number, line.c_str());
+                exit(EXIT_FAILURE);
+            }
+            tris.push_back(t);
+            continue;
+        }
+        if(item!="render" && item!="render_instanced")
+        {
+            lines.push_back(line);
+            continue;
+        }
+
+        // Reorder the draw if it is indexed and its indices are valid.
+        ss>>name;
+        int num_vertices = vertices.size();
+        bool valid = name=="indexed";
+        for(size_t t = 0; t < tris.size() && valid; t++) {
+            for(int j = 0; j < 3; j++) {
+                if(tris[t].v[j] < 0 || tris[t].v[j] >= num_vertices) valid = false;
+            }
+        }
+        std::vector<int> order(num_vertices);
+        for(int v = 0; v < num_vertices; v++) order[v] = v;
+        if(valid) {
+            double before = acmr(tris, num_vertices, cache_size);
+            tris = tipsify(tris, num_vertices, cache_size);
+
+            // Number the vertices in order of first use; unused vertices
+            // keep their relative order at the end.
+            std::vector<int> remap(num_vertices, -1);
+            int next = 0;
+            for(size_t t = 0; t < tris.size(); t++) {
+                for(int j = 0; j < 3; j++) {
+                    int& v = tris[t].v[j];
+                    if(remap[v] < 0) remap[v] = next++;
+                    v = remap[v];
+                }
+            }
+            for(int v = 0; v < num_vertices; v++) {
+                if(remap[v] < 0) remap[v] = next++;
+                order[remap[v]] = v;
+            }
+            printf("draw %d: %d triangles, %d vertices, acmr %.3f -> %.3f\n", draw,
+                (int)tris.size(), num_vertices, before, acmr(tris, num_vertices, cache_size));
+        }
+
+        for(size_t i = 0; i < lines.size(); i++) {
+            if((int)i == first_v) {
+                for(int v = 0; v < num_vertices; v++) output += vertices[order[v]];
+            }
+            if((int)i == first_f) {
+                for(size_t t = 0; t < tris.size(); t++) {
+                    std::stringstream f;
+                    f<<"f "<<tris[t].v[0]<<" "<<tris[t].v[1]<<" "<<tris[t].v[2]<<"\n";
+                    output += f.str();
+                }
+            }
+            output += lines[i];
+        }
+        output += line;
+
+        lines.clear();
+        vertices.clear();
+        tris.clear();
+        first_v = first_f = -1;
+        draw++;
+    }
+    fclose(in);
+
+    // Anything after the last render has no effect, but is kept.
+    for(size_t i = 0; i < lines.size(); i++) {
+        if((int)i == first_v) {
+            for(size_t v = 0; v < vertices.size(); v++) output += vertices[v];
+        }
+        if((int)i == first_f) {
+            for(size_t t = 0; t < tris.size(); t++) {
+                std::stringstream f;
+                f<<"f "<<tris[t].v[0]<<" "<<tris[t].v[1]<<" "<<tris[t].v[2]<<"\n";
+                output += f.str();
+            }
+        }
+        output += lines[i];
+    }
+
+    FILE* out = fopen(output_file, "w");
+    if(!out)
+    {
+        printf("Failed to open file '%s'\n", output_file);
+        exit(EXIT_FAILURE);
+    }
+    fputs(output.c_str(), out);
+    fclose(out);
+    return 0;
+}
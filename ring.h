@@ -0,0 +1,123 @@
+#ifndef __RING__
+#define __RING__
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Size of a cache line, in bytes.
+static const size_t CACHE_LINE = 64;
+
+// A bounded queue between one producer thread and one consumer thread, with
+// no locks.  Items live in a fixed array of slots, so the queue never
+// allocates after construction.  The producer fills the slot returned by
+// back and publishes it with push; the consumer reads the slot returned by
+// front and releases it with pop, so items are used in place rather than
+// copied in and out.  A slot is only reused after it has been popped.
+template<class T>
+class spsc_ring
+{
+public:
+    // capacity must be a power of two.
+    explicit spsc_ring(size_t capacity)
+        :slots(capacity), mask(capacity - 1)
+    {}
+
+    // Producer: the slot for the next item, or null if the queue is full.
+    T* back()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) == slots.size()) { return 0; }
+        return &slots[h & mask];
+    }
+
+    // Producer: publish the item written to the slot returned by back.
+    void push()
+    {head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);}
+
+    // Producer: no more items will be pushed.
+    void close()
+    {closed.store(true, std::memory_order_release);}
+
+    // Consumer: the oldest item, or null if the queue is empty.
+    T* front()
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(head.load(std::memory_order_acquire) == t) { return 0; }
+        return &slots[t & mask];
+    }
+
+    // Consumer: release the item returned by front.
+    void pop()
+    {tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);}
+
+    // Like back, but waits for a free slot if the queue is full, adding one
+    // to stalls if it had to wait.
+    T* wait_back(long& stalls)
+    {
+        T* slot = back();
+        if(slot) { return slot; }
+        stalls++;
+        while(!(slot = back())) { std::this_thread::yield(); }
+        return slot;
+    }
+
+    // Like front, but waits for an item if the queue is empty, adding one to
+    // stalls if it had to wait.  Returns null once the queue is empty and
+    // closed.
+    T* wait_front(long& stalls)
+    {
+        T* item = front();
+        if(item) { return item; }
+        stalls++;
+        while(!(item = front())) {
+            // Items pushed before close are visible once closed is.
+            if(closed.load(std::memory_order_acquire)) { return front(); }
+            std::this_thread::yield();
+        }
+        return item;
+    }
+
+    // Producer: wait until the consumer has popped every item pushed.
+    void wait_empty() const
+    {
+        while(tail.load(std::memory_order_acquire) != head.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Number of items in the queue; exact when called by the producer or
+    // consumer, up to items the other side is pushing or popping.
+    size_t size() const
+    {return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);}
+
+    // Empty the queue and reopen it.  Neither side may be using it.
+    void reset()
+    {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        closed.store(false, std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // Items pushed and popped so far.  Kept on separate cache lines, since
+    // each is written by a different thread.  The members are padded apart
+    // rather than aligned, so that the queue needs no over-aligned
+    // allocation: any two bytes at least a line apart are on different
+    // lines.
+    char pad_head[CACHE_LINE];
+    std::atomic<size_t> head{0};
+    char pad_tail[CACHE_LINE];
+    std::atomic<size_t> tail{0};
+    char pad_closed[CACHE_LINE];
+    std::atomic<bool> closed{false};
+
+    spsc_ring(const spsc_ring&);
+    spsc_ring& operator = (const spsc_ring&);
+};
+
+#endif
@@ -0,0 +1,400 @@
+#include "shader_vm.h"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+static bool is_unary(vm_op op)
+{
+    return op == vm_op::neg || op == vm_op::abs || op == vm_op::sqrt || op == vm_op::floor;
+}
+
+static bool is_ternary(vm_op op)
+{
+    return op == vm_op::fma || op == vm_op::fms;
+}
+
+// The operations on single floats.  Constant folding and the interpreter both
+// use these, so folded values are exactly those the program would compute.
+static inline float vm_min(float a, float b) {return b < a ? b : a;}
+static inline float vm_max(float a, float b) {return a < b ? b : a;}
+
+static float vm_evaluate(vm_op op, float a, float b, float c)
+{
+    switch(op) {
+        case vm_op::add: return a + b;
+        case vm_op::sub: return a - b;
+        case vm_op::mul: return a * b;
+        case vm_op::div: return a / b;
+        case vm_op::min: return vm_min(a, b);
+        case vm_op::max: return vm_max(a, b);
+        case vm_op::neg: return -a;
+        case vm_op::abs: return std::fabs(a);
+        case vm_op::sqrt: return std::sqrt(a);
+        case vm_op::floor: return std::floor(a);
+        case vm_op::fma: {float p = a * b; return p + c;}
+        case vm_op::fms: {float p = a * b; return p - c;}
+    }
+    return 0;
+}
+
+// An operand while compiling an expression: a value, or a product a*b that
+// has not been emitted yet, so that an addition or subtraction using it can
+// become an fma or fms instead.
+struct vm_operand
+{
+    int value;
+    int mul_a, mul_b;
+};
+
+// Recursive descent compiler for the statements of one shader.
+struct shader_compiler
+{
+    const char* name;
+    int line;
+    const char* p;
+    shader_program& program;
+    std::map<std::string,int> variables;
+
+    shader_compiler(const char* name, shader_program& program)
+        :name(name), line(0), p(0), program(program)
+    {}
+
+    void error(const char* message, const std::string& detail = "")
+    {
+        printf("Error in shader '%s', line %d: %s%s\n", name, line, message, detail.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // The number of a value, added if there is no equal one yet.
+    int value(vm_source source, int index, float constant)
+    {
+        for(size_t i = 0; i < program.values.size(); i++) {
+            const vm_value& v = program.values[i];
+            if(v.source != source || source == vm_source::result) { continue; }
+            if(source == vm_source::constant ? !memcmp(&v.constant, &constant, sizeof(float)) : v.index == index) {
+                return i;
+            }
+        }
+        return add_value(source, index, constant);
+    }
+
+    int add_value(vm_source source, int index, float constant)
+    {
+        if((int)program.values.size() == VM_MAX_VALUES) { error("too many values"); }
+        program.values.push_back(vm_value{source, index, constant});
+        return program.values.size() - 1;
+    }
+
+    int emit(vm_op op, int a, int b = 0, int c = 0)
+    {
+        int dst = add_value(vm_source::result, 0, 0);
+        if(is_unary(op)) { b = c = a; }
+        else if(!is_ternary(op)) { c = a; }
+        program.instructions.push_back(vm_instruction{op, (unsigned char)dst,
+            (unsigned char)a, (unsigned char)b, (unsigned char)c});
+        return dst;
+    }
+
+    int materialize(const vm_operand& e)
+    {
+        return e.value >= 0 ? e.value : emit(vm_op::mul, e.mul_a, e.mul_b);
+    }
+
+    vm_operand operand(int value)
+    {return vm_operand{value, 0, 0};}
+
+    void skip_space()
+    {
+        while(isspace(*p)) { p++; }
+    }
+
+    bool accept(char c)
+    {
+        skip_space();
+        if(*p != c) { return false; }
+        p++;
+        return true;
+    }
+
+    void expect(char c)
+    {
+        if(!accept(c)) { error("expected ", std::string(1, c)); }
+    }
+
+    std::string identifier()
+    {
+        skip_space();
+        const char* start = p;
+        if(!isalpha(*p) && *p != '_') { error("expected a name"); }
+        while(isalnum(*p) || *p == '_') { p++; }
+        return std::string(start, p);
+    }
+
+    // If s is prefix followed by a number, store the number in index.
+    static bool indexed_name(const std::string& s, const char* prefix, int& index)
+    {
+        size_t n = strlen(prefix);
+        if(s.size() <= n || s.compare(0, n, prefix)) { return false; }
+        for(size_t i = n; i < s.size(); i++) {
+            if(!isdigit(s[i])) { return false; }
+        }
+        index = atoi(s.c_str() + n);
+        return true;
+    }
+
+    vm_operand call(const std::string& function)
+    {
+        std::vector<int> args;
+        if(!accept(')')) {
+            do { args.push_back(materialize(expression())); } while(accept(','));
+            expect(')');
+        }
+        struct builtin {const char* name; int num_args;};
+        static const builtin functions[] = {
+            {"min", 2}, {"max", 2}, {"abs", 1}, {"sqrt", 1}, {"floor", 1}, {"clamp", 3}, {"mix", 3}
+        };
+        for(const builtin& f : functions) {
+            if(function != f.name) { continue; }
+            if((int)args.size() != f.num_args) { error("wrong number of arguments to ", function); }
+            if(function == "min") { return operand(emit(vm_op::min, args[0], args[1])); }
+            if(function == "max") { return operand(emit(vm_op::max, args[0], args[1])); }
+            if(function == "abs") { return operand(emit(vm_op::abs, args[0])); }
+            if(function == "sqrt") { return operand(emit(vm_op::sqrt, args[0])); }
+            if(function == "floor") { return operand(emit(vm_op::floor, args[0])); }
+            if(function == "clamp") { return operand(emit(vm_op::min, emit(vm_op::max, args[0], args[1]), args[2])); }
+            // mix(a,b,t) = (b-a)*t+a
+            return operand(emit(vm_op::fma, emit(vm_op::sub, args[1], args[0]), args[2], args[0]));
+        }
+        error("unknown function ", function);
+        return operand(0);
+    }
+
+    vm_operand primary()
+    {
+        if(accept('(')) {
+            vm_operand e = expression();
+            expect(')');
+            return e;
+        }
+        skip_space();
+        if(isdigit(*p) || *p == '.') {
+            char* end;
+            float x = strtof(p, &end);
+            p = end;
+            return operand(value(vm_source::constant, 0, x));
+        }
+        std::string s = identifier();
+        if(accept('(')) { return call(s); }
+        int index;
+        if(indexed_name(s, "in", index)) {
+            if(index >= MAX_FLOATS_PER_VERTEX) { error("no such input ", s); }
+            return operand(value(vm_source::input, index, 0));
+        }
+        if(indexed_name(s, "u", index)) { return operand(value(vm_source::uniform, index, 0)); }
+        if(!variables.count(s)) { error("undefined variable ", s); }
+        return operand(variables[s]);
+    }
+
+    vm_operand unary()
+    {
+        if(accept('-')) { return operand(emit(vm_op::neg, materialize(unary()))); }
+        return primary();
+    }
+
+    vm_operand term()
+    {
+        vm_operand left = unary();
+        while(true) {
+            bool mul = accept('*');
+            if(!mul && !accept('/')) { return left; }
+            int a = materialize(left);
+            int b = materialize(unary());
+            left = mul ? vm_operand{-1, a, b} : operand(emit(vm_op::div, a, b));
+        }
+    }
+
+    // Products directly added to or subtracted from something are fused.
+    vm_operand expression()
+    {
+        vm_operand left = term();
+        while(true) {
+            bool add = accept('+');
+            if(!add && !accept('-')) { return left; }
+            vm_operand right = term();
+            if(left.value < 0) {
+                left = operand(emit(add ? vm_op::fma : vm_op::fms, left.mul_a, left.mul_b, materialize(right)));
+            } else if(right.value < 0 && add) {
+                left = operand(emit(vm_op::fma, right.mul_a, right.mul_b, left.value));
+            } else {
+                left = operand(emit(add ? vm_op::add : vm_op::sub, left.value, materialize(right)));
+            }
+        }
+    }
+
+    void statement(const char* text)
+    {
+        p = text;
+        std::string dst = identifier();
+        int index;
+        if(indexed_name(dst, "in", index) || indexed_name(dst, "u", index)) { error("cannot assign to ", dst); }
+        if(indexed_name(dst, "out", index) && index > 3) { error("no such output ", dst); }
+        expect('=');
+        variables[dst] = materialize(expression());
+        skip_space();
+        if(*p && *p != '#') { error("unexpected text: ", p); }
+    }
+};
+
+void compile_shader(const char* name, const std::vector<std::string>& lines, shader_program& program)
+{
+    program.values.clear();
+    program.instructions.clear();
+    shader_compiler compiler(name, program);
+    for(size_t i = 0; i < lines.size(); i++) {
+        compiler.line = i + 1;
+        const char* text = lines[i].c_str();
+        while(isspace(*text)) { text++; }
+        if(!*text || *text == '#') { continue; }
+        compiler.statement(text);
+    }
+    for(int c = 0; c < 4; c++) {
+        std::string out = "out" + std::to_string(c);
+        program.outputs[c] = compiler.variables.count(out) ? compiler.variables[out] : compiler.value(vm_source::constant, 0, 0);
+    }
+}
+
+void bind_shader(shader_program& program, const float* uniform_data, int uniform_size,
+    int floats_per_vertex)
+{
+    // Values known before shading, and what they are.
+    std::vector<char> known(program.values.size(), 0);
+    std::vector<float> value(program.values.size(), 0);
+    for(size_t i = 0; i < program.values.size(); i++) {
+        const vm_value& v = program.values[i];
+        if(v.source == vm_source::input && v.index >= floats_per_vertex) {
+            printf("Shader reads in%d, but the vertex data has %d floats\n", v.index, floats_per_vertex);
+            exit(EXIT_FAILURE);
+        }
+        if(v.source == vm_source::uniform && v.index >= uniform_size) {
+            printf("Shader reads u%d, but the uniform data has %d floats\n", v.index, uniform_size);
+            exit(EXIT_FAILURE);
+        }
+        if(v.source == vm_source::constant) { known[i] = 1; value[i] = v.constant; }
+        if(v.source == vm_source::uniform && uniform_data) { known[i] = 1; value[i] = uniform_data[v.index]; }
+    }
+
+    // Fold instructions whose operands are known.  A fused product of known
+    // values becomes a new known value.
+    std::vector<vm_instruction> code;
+    for(size_t i = 0; i < program.instructions.size(); i++) {
+        vm_instruction ins = program.instructions[i];
+        if(known[ins.a] && known[ins.b] && known[ins.c]) {
+            known[ins.dst] = 1;
+            value[ins.dst] = vm_evaluate(ins.op, value[ins.a], value[ins.b], value[ins.c]);
+            continue;
+        }
+        if(is_ternary(ins.op) && known[ins.a] && known[ins.b]) {
+            known.push_back(1);
+            value.push_back(value[ins.a] * value[ins.b]);
+            ins.op = ins.op == vm_op::fma ? vm_op::add : vm_op::sub;
+            ins.a = known.size() - 1;
+            ins.b = ins.c;
+            ins.c = ins.a;
+        }
+        code.push_back(ins);
+    }
+
+    // Values the outputs depend on.
+    std::vector<char> live(known.size(), 0);
+    for(int c = 0; c < 4; c++) { live[program.outputs[c]] = 1; }
+    for(size_t i = code.size(); i-- > 0;) {
+        if(live[code[i].dst]) { live[code[i].a] = live[code[i].b] = live[code[i].c] = 1; }
+    }
+
+    // Assign the registers.
+    std::vector<int> reg(known.size(), -1);
+    program.inputs.clear();
+    program.uniforms.clear();
+    program.constants.clear();
+    for(size_t i = 0; i < program.values.size(); i++) {
+        if(!live[i] || program.values[i].source != vm_source::input) { continue; }
+        reg[i] = program.inputs.size();
+        program.inputs.push_back(program.values[i].index);
+    }
+    int num_registers = program.inputs.size();
+    for(size_t i = 0; i < program.values.size(); i++) {
+        if(!live[i] || known[i] || program.values[i].source != vm_source::uniform) { continue; }
+        reg[i] = num_registers++;
+        program.uniforms.push_back(program.values[i].index);
+    }
+    std::map<unsigned int,int> constant_registers;
+    for(size_t i = 0; i < known.size(); i++) {
+        if(!live[i] || !known[i]) { continue; }
+        unsigned int bits;
+        memcpy(&bits, &value[i], sizeof(bits));
+        if(!constant_registers.count(bits)) {
+            constant_registers[bits] = num_registers++;
+            program.constants.insert(program.constants.end(), FRAGMENT_PACKET_SIZE, value[i]);
+        }
+        reg[i] = constant_registers[bits];
+    }
+    program.code.clear();
+    for(size_t i = 0; i < code.size(); i++) {
+        vm_instruction ins = code[i];
+        if(!live[ins.dst]) { continue; }
+        reg[ins.dst] = num_registers++;
+        program.code.push_back(vm_instruction{ins.op, (unsigned char)reg[ins.dst],
+            (unsigned char)reg[ins.a], (unsigned char)reg[ins.b], (unsigned char)reg[ins.c]});
+    }
+    for(int c = 0; c < 4; c++) { program.output_registers[c] = reg[program.outputs[c]]; }
+}
+
+// Apply an operation to every fragment of the packet.
+#define VM_LANES(expr) \
+    for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) { d[k] = (expr); } \
+    break
+
+void run_shader(const shader_program& program, const data_fragment_packet& in,
+    data_output_packet& out, const float * uniform_data)
+{
+    float r[VM_REGISTERS][FRAGMENT_PACKET_SIZE];
+    int n = 0;
+    for(size_t i = 0; i < program.inputs.size(); i++, n++) {
+        memcpy(r[n], in.data + program.inputs[i] * FRAGMENT_PACKET_SIZE, sizeof(r[n]));
+    }
+    for(size_t i = 0; i < program.uniforms.size(); i++, n++) {
+        for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) { r[n][k] = uniform_data[program.uniforms[i]]; }
+    }
+    if(program.constants.size()) {
+        memcpy(r[n], &program.constants[0], program.constants.size() * sizeof(float));
+    }
+
+    for(size_t i = 0; i < program.code.size(); i++) {
+        const vm_instruction& ins = program.code[i];
+        float* d = r[ins.dst];
+        const float* a = r[ins.a];
+        const float* b = r[ins.b];
+        const float* c = r[ins.c];
+        switch(ins.op) {
+            case vm_op::add: VM_LANES(a[k] + b[k]);
+            case vm_op::sub: VM_LANES(a[k] - b[k]);
+            case vm_op::mul: VM_LANES(a[k] * b[k]);
+            case vm_op::div: VM_LANES(a[k] / b[k]);
+            case vm_op::min: VM_LANES(vm_min(a[k], b[k]));
+            case vm_op::max: VM_LANES(vm_max(a[k], b[k]));
+            case vm_op::neg: VM_LANES(-a[k]);
+            case vm_op::abs: VM_LANES(std::fabs(a[k]));
+            case vm_op::sqrt: VM_LANES(std::sqrt(a[k]));
+            case vm_op::floor: VM_LANES(std::floor(a[k]));
+            case vm_op::fma: VM_LANES(a[k] * b[k] + c[k]);
+            case vm_op::fms: VM_LANES(a[k] * b[k] - c[k]);
+        }
+    }
+
+    for(int c = 0; c < 4; c++) {
+        memcpy(out.output_color[c], r[program.output_registers[c]], sizeof(out.output_color[c]));
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef __SHADER_VM__
+#define __SHADER_VM__
+
+#include "common.h"
+#include <string>
+#include <vector>
+
+// Fragment shaders defined in scene files (see the shader command in
+// parse.cpp), run by a small interpreter.  The body of a shader is a list of
+// statements of the form
+//
+//     <name> = <expression>
+//
+// where <name> is out0 .. out3 (the components of the output color) or a
+// local variable.  Expressions are built from numbers, local variables,
+// in<i> (float i of the fragment's data, laid out as in vertex_data), u<i>
+// (float i of the uniform data), the operators + - * / with the usual
+// precedence, unary -, parentheses, and the functions min(a,b), max(a,b),
+// abs(a), sqrt(a), floor(a), clamp(x,lo,hi) and mix(a,b,t).  Components of
+// the color that are not assigned are 0.
+//
+// A shader is compiled once, when it is loaded, to a register-based
+// bytecode in single assignment form, where a*b+c and a*b-c become single
+// instructions.  Before each draw it is bound to the draw's uniform data:
+// uniforms and everything computed only from uniforms and numbers are folded
+// into constants, and instructions whose results are not used are dropped.
+// The bound program shades a whole packet of fragments per instruction.
+
+// Maximum number of values (inputs, uniforms, numbers and results of
+// operations) of a compiled shader.
+static const int VM_MAX_VALUES = 128;
+
+// Number of registers of the interpreter.  Binding adds at most one
+// constant per instruction, so this bounds the registers of any program.
+static const int VM_REGISTERS = 2 * VM_MAX_VALUES;
+
+enum class vm_op : unsigned char {add, sub, mul, div, min, max, neg, abs, sqrt, floor, fma, fms};
+
+// dst = op(a, b, c).  fma computes a*b+c and fms a*b-c, rounding the product
+// as mul would.  Unary operations only use a.  Operands are value numbers in
+// a compiled shader and registers in a bound program.
+struct vm_instruction
+{
+    vm_op op;
+    unsigned char dst, a, b, c;
+};
+
+// Where a value of a compiled shader comes from.
+enum class vm_source {input, uniform, constant, result};
+
+struct vm_value
+{
+    vm_source source;
+    int index;      // float of the data, for inputs and uniforms
+    float constant; // for constants
+};
+
+struct shader_program
+{
+    // Compiled form: the values, and the instructions computing the results.
+    std::vector<vm_value> values;
+    std::vector<vm_instruction> instructions;
+    int outputs[4];
+
+    // Bound form.  Registers are numbered inputs first, then uniforms, then
+    // constants, then results.  inputs[i] is the float of the fragment data
+    // in register i, and uniforms[i] the uniform float in register
+    // inputs.size() + i.  constants holds the values of the constant
+    // registers, each repeated for every fragment of a packet.
+    std::vector<int> inputs;
+    std::vector<int> uniforms;
+    std::vector<float> constants;
+    std::vector<vm_instruction> code;
+    int output_registers[4];
+};
+
+// Compile the statements of the shader called name.  Errors are reported
+// with the name and line and exit the program.
+void compile_shader(const char* name, const std::vector<std::string>& lines, shader_program& program);
+
+// Bind a compiled shader to the uniform data of a draw, which has
+// uniform_size floats.  If uniform_data is null (the uniform data varies
+// between instances), uniforms are not folded and are read when shading.
+// floats_per_vertex is the size of the fragment data.
+void bind_shader(shader_program& program, const float* uniform_data, int uniform_size,
+    int floats_per_vertex);
+
+// Shade a packet of fragments with a bound shader.
+void run_shader(const shader_program& program, const data_fragment_packet& in,
+    data_output_packet& out, const float * uniform_data);
+
+#endif
@@ -2,7 +2,10 @@
 
 // Lookup maps to access a shader by name.
 std::map<std::string,shader_v> vertex_shader_map;
+std::map<std::string,shader_v_batch> vertex_shader_batch_map;
+std::set<std::string> transform_vertex_shaders;
 std::map<std::string,shader_f> fragment_shader_map;
+std::map<std::string,shader_f_packet> fragment_shader_packet_map;
 
 // Simplest useful vertex shader; just copies over the positions.
 void vertex_shader_trivial(const data_vertex& in, data_geometry& out,
@@ -32,48 +35,63 @@ void vertex_shader_transform(const data_vertex& in, data_geometry& out,
     out.gl_Position = xform * vec4(v.position,1);
 }
 
-// Simple fragment shader: set the fragment to red
-void fragment_shader_red(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+// Batched versions of the vertex shaders above.  Each statement is a loop
+// over the vertices of the batch, which the compiler can vectorize.  The
+// products are summed in the same order as in mat4::operator*, so the
+// results are identical to those of the per-vertex shaders.
+static void transform_batch(const data_vertex_batch& in, data_geometry_batch& out,
+        const mat4& xform)
 {
-    out.output_color = vec4(1,0,0,0);
+    const float* x = in.data;
+    const float* y = in.data + VERTEX_BATCH_SIZE;
+    const float* z = in.data + 2 * VERTEX_BATCH_SIZE;
+    for(int i = 0; i < 4; i++) {
+        float* p = out.gl_Position[i];
+        for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+            p[k] = xform(i,0) * x[k] + xform(i,1) * y[k] + xform(i,2) * z[k] + xform(i,3);
+        }
+    }
 }
 
-// Simple fragment shader: set the fragment to green
-void fragment_shader_green(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+void vertex_shader_trivial_batch(const data_vertex_batch& in, data_geometry_batch& out,
+        const float * uniform_data)
 {
-    out.output_color = vec4(0,1,0,0);
+    for(int i = 0; i < 3; i++) {
+        for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+            out.gl_Position[i][k] = in.data[i * VERTEX_BATCH_SIZE + k];
+        }
+    }
+    for(int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+        out.gl_Position[3][k] = 1;
+    }
 }
 
-// Simple fragment shader: set the fragment to blue
-void fragment_shader_blue(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+void vertex_shader_transform_batch(const data_vertex_batch& in, data_geometry_batch& out,
+        const float * uniform_data)
 {
-    out.output_color = vec4(0,0,1,0);
+    transform_batch(in, out, *(const mat4*)uniform_data);
 }
 
-// Simple fragment shader: set the fragment to white
-void fragment_shader_white(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+// The colors (floats 3-5) are passed through, and out.data already holds
+// them.
+void vertex_shader_color_batch(const data_vertex_batch& in, data_geometry_batch& out,
+        const float * uniform_data)
 {
-    out.output_color = vec4(1,1,1,0);
+    transform_batch(in, out, *(const mat4*)uniform_data);
 }
 
-// Simple fragment shader: pass through globally constant color
-void fragment_shader_uniform(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+// Add the fragment shaders in the list to fragment_shader_map and
+// fragment_shader_packet_map.
+static void register_fragment_shaders(shader_list<>)
 {
-    transform_color& tc = *(transform_color*)uniform_data;
-    out.output_color = vec4(tc.color,0);
 }
 
-// Simple fragment shader: pass through interpolated per-vertex color
-void fragment_shader_gouraud(const data_fragment& in, data_output& out,
-    const float * uniform_data)
+template<class shader, class... rest>
+static void register_fragment_shaders(shader_list<shader, rest...>)
 {
-    vertex_pc& v = *(vertex_pc*)in.data;
-    out.output_color = vec4(v.color,0);
+    fragment_shader_map[shader::name()]=shader::shade;
+    fragment_shader_packet_map[shader::name()]=shader::shade_packet;
+    register_fragment_shaders(shader_list<rest...>());
 }
 
 // Assign shaders to the maps so they can be accessed by name.
@@ -82,10 +100,10 @@ void register_named_shaders()
     vertex_shader_map["trivial"]=vertex_shader_trivial;
     vertex_shader_map["transform"]=vertex_shader_transform;
     vertex_shader_map["color"]=vertex_shader_color;
-    fragment_shader_map["red"]=fragment_shader_red;
-    fragment_shader_map["green"]=fragment_shader_green;
-    fragment_shader_map["blue"]=fragment_shader_blue;
-    fragment_shader_map["white"]=fragment_shader_white;
-    fragment_shader_map["gouraud"]=fragment_shader_gouraud;
-    fragment_shader_map["uniform"]=fragment_shader_uniform;
+    vertex_shader_batch_map["trivial"]=vertex_shader_trivial_batch;
+    vertex_shader_batch_map["transform"]=vertex_shader_transform_batch;
+    vertex_shader_batch_map["color"]=vertex_shader_color_batch;
+    transform_vertex_shaders.insert("transform");
+    transform_vertex_shaders.insert("color");
+    register_fragment_shaders(builtin_fragment_shaders());
 }
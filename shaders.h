@@ -4,6 +4,7 @@
 #include "common.h"
 #include "mat.h"
 #include <map>
+#include <set>
 
 // Vertex layout: each vertex stores only position, as a 3-vector
 struct vertex_p
@@ -29,8 +30,152 @@ struct transform_color : public uniform_transform
     vec3 color;
 };
 
+// Built-in fragment shaders, as types.  Each has the name that selects it in
+// scene files, a static shade function with the shader_f signature, and a
+// static shade_packet function with the shader_f_packet signature, which
+// shades a packet of fragments the same way.  invariant is true if the shader
+// ignores its input data, so that every fragment of a draw gets the same
+// color.  The raster kernels are instantiated for every shader in
+// builtin_fragment_shaders, so that its body is inlined into the pixel loop.
+
+// Set every fragment of a packet to color.
+inline void fill_packet(data_output_packet& out, const vec4& color)
+{
+    for(int c = 0; c < 4; c++) {
+        for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+            out.output_color[c][k] = color[c];
+        }
+    }
+}
+
+// Simple fragment shader: set the fragment to red
+struct fragment_red
+{
+    static const char* name() {return "red";}
+    static const bool invariant = true;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        out.output_color = vec4(1,0,0,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        fill_packet(out, vec4(1,0,0,0));
+    }
+};
+
+// Simple fragment shader: set the fragment to green
+struct fragment_green
+{
+    static const char* name() {return "green";}
+    static const bool invariant = true;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        out.output_color = vec4(0,1,0,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        fill_packet(out, vec4(0,1,0,0));
+    }
+};
+
+// Simple fragment shader: set the fragment to blue
+struct fragment_blue
+{
+    static const char* name() {return "blue";}
+    static const bool invariant = true;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        out.output_color = vec4(0,0,1,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        fill_packet(out, vec4(0,0,1,0));
+    }
+};
+
+// Simple fragment shader: set the fragment to white
+struct fragment_white
+{
+    static const char* name() {return "white";}
+    static const bool invariant = true;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        out.output_color = vec4(1,1,1,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        fill_packet(out, vec4(1,1,1,0));
+    }
+};
+
+// Simple fragment shader: pass through globally constant color
+struct fragment_uniform
+{
+    static const char* name() {return "uniform";}
+    static const bool invariant = true;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        const transform_color& tc = *(const transform_color*)uniform_data;
+        out.output_color = vec4(tc.color,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        const transform_color& tc = *(const transform_color*)uniform_data;
+        fill_packet(out, vec4(tc.color,0));
+    }
+};
+
+// Simple fragment shader: pass through interpolated per-vertex color
+struct fragment_gouraud
+{
+    static const char* name() {return "gouraud";}
+    static const bool invariant = false;
+    static void shade(const data_fragment& in, data_output& out,
+        const float * uniform_data)
+    {
+        const vertex_pc& v = *(const vertex_pc*)in.data;
+        out.output_color = vec4(v.color,0);
+    }
+    static void shade_packet(const data_fragment_packet& in, data_output_packet& out,
+        const float * uniform_data)
+    {
+        // the color is floats 3-5 of vertex_pc
+        for(int c = 0; c < 3; c++) {
+            for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+                out.output_color[c][k] = in.data[(3 + c) * FRAGMENT_PACKET_SIZE + k];
+            }
+        }
+        for(int k = 0; k < FRAGMENT_PACKET_SIZE; k++) {
+            out.output_color[3][k] = 0;
+        }
+    }
+};
+
+// A list of shader types.
+template<class... shaders>
+struct shader_list {};
+
+typedef shader_list<fragment_red, fragment_green, fragment_blue, fragment_white,
+    fragment_uniform, fragment_gouraud> builtin_fragment_shaders;
+
 extern std::map<std::string,shader_v> vertex_shader_map;
+extern std::map<std::string,shader_v_batch> vertex_shader_batch_map;
+
+// Vertex shaders that output the uniform_transform applied to the vertex_p
+// position, and nothing else that depends on it.
+extern std::set<std::string> transform_vertex_shaders;
 extern std::map<std::string,shader_f> fragment_shader_map;
+extern std::map<std::string,shader_f_packet> fragment_shader_packet_map;
 void register_named_shaders();
 
 #endif
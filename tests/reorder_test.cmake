@@ -0,0 +1,25 @@
+# Check that reordering a scene does not change the image it renders.
+# Called by ctest with DRIVER, REORDER and SCENE set; runs in a scratch
+# directory, since the driver writes output.png to the current directory.
+
+execute_process(COMMAND ${DRIVER} -i ${SCENE} -o original.stats RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "rendering ${SCENE} failed")
+endif()
+file(RENAME output.png original.png)
+
+execute_process(COMMAND ${REORDER} -i ${SCENE} -o reordered.txt RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "reordering ${SCENE} failed")
+endif()
+
+execute_process(COMMAND ${DRIVER} -i reordered.txt -o reordered.stats RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "rendering the reordered scene failed")
+endif()
+
+file(SHA256 original.png original)
+file(SHA256 output.png reordered)
+if(NOT original STREQUAL reordered)
+    message(FATAL_ERROR "the reordered scene renders a different image")
+endif()
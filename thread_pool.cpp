@@ -0,0 +1,66 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(int num_threads)
+    : next(0)
+{
+    for(int i = 1; i < num_threads; i++) {
+        threads.push_back(std::thread(&thread_pool::worker, this));
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for(size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void thread_pool::parallel_for(int count, const std::function<void(int)>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->job = &job;
+        this->count = count;
+        next = 0;
+        busy = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    run_jobs();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]{return busy == 0;});
+    this->job = 0;
+}
+
+// Take indices until there are none left.
+void thread_pool::run_jobs()
+{
+    for(int i = next++; i < count; i = next++) {
+        (*job)(i);
+    }
+}
+
+void thread_pool::worker()
+{
+    long seen = 0;
+    while(1) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{return quit || generation != seen;});
+            if(quit) return;
+            seen = generation;
+        }
+
+        run_jobs();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--busy == 0) done.notify_one();
+    }
+}
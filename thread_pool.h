@@ -0,0 +1,51 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads used to run the parallel stages of the
+// driver.  The threads are created once and sleep between jobs, so the pool
+// can be reused cheaply for every render call.
+class thread_pool
+{
+public:
+    // Create a pool that runs jobs on num_threads threads in total.  The
+    // thread calling parallel_for is one of them, so num_threads-1 worker
+    // threads are started.
+    explicit thread_pool(int num_threads);
+    ~thread_pool();
+
+    // Call job(i) for i = 0, 1, ..., count-1, spread across the threads of
+    // the pool.  Each index is handed to exactly one thread.  Returns once all
+    // calls have finished.
+    void parallel_for(int count, const std::function<void(int)>& job);
+
+    // Total number of threads, including the calling thread.
+    int size() const
+    {return threads.size() + 1;}
+
+private:
+    void worker();
+    void run_jobs();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    // Current job; protected by mutex, except for next which hands out the
+    // indices.
+    const std::function<void(int)>* job = 0;
+    int count = 0;
+    std::atomic<int> next;
+    int busy = 0;
+    long generation = 0;
+    bool quit = false;
+};
+
+#endif